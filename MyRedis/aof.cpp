@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "aof.h"
+#include "utils.h"
+
+// a rewrite starts once the AOF is this large and has doubled
+const uint64_t K_AOF_REWRITE_MIN = 64 << 20;
+// the tail is copied to the rewrite by this size
+const size_t K_AOF_COPY_CHUNK = 64 << 10;
+
+static struct {
+    int fd = -1;
+    uint32_t policy = AOF_FSYNC_EVERYSEC;
+    std::string path;
+    std::atomic<uint64_t> size{0};      // the loops append concurrently
+    std::atomic<uint64_t> base_size{0}; // after the last rewrite
+    // during a rewrite. set and cleared with the loops paused,
+    // the pause orders them with the writes of the loops.
+    int tail_fd = -1;
+    int rewrite_fd = -1;
+    uint64_t tail_copied = 0;           // the bytes of the tail in the rewrite
+} g_aof;
+
+static std::string aof_rewrite_path() {
+    return g_aof.path + ".rewrite";
+}
+
+static std::string aof_tail_path() {
+    return g_aof.path + ".tail";
+}
+
+static void aof_fsync_run() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        // the rewrite replaces the file with dup2(), the fd stays valid
+        if (fdatasync(g_aof.fd) < 0) {
+            msg("fdatasync() aof");
+        }
+    }
+}
+
+void aof_open(const char *path, uint32_t policy) {
+    // O_APPEND keeps the batches of the loops whole
+    g_aof.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (g_aof.fd < 0) {
+        die("open() aof");
+    }
+    g_aof.path = path;
+    g_aof.size = (uint64_t) lseek(g_aof.fd, 0, SEEK_END);
+    g_aof.base_size = g_aof.size.load();
+    g_aof.policy = policy;
+    if (policy == AOF_FSYNC_EVERYSEC) {
+        std::thread(aof_fsync_run).detach();
+    }
+}
+
+bool aof_enabled() {
+    return g_aof.fd >= 0;
+}
+
+uint32_t aof_policy() {
+    return g_aof.policy;
+}
+
+void aof_append(Buffer *batch, const std::vector<std::string_view> &cmd) {
+    size_t len = 4;
+    for (std::string_view arg : cmd) {
+        len += 4 + arg.size();
+    }
+    buf_reserve(batch, 4 + len);
+    buf_append_u32(batch, (uint32_t) len);
+    buf_append_u32(batch, (uint32_t) cmd.size());
+    for (std::string_view arg : cmd) {
+        buf_append_u32(batch, (uint32_t) arg.size());
+        buf_append(batch, (const uint8_t *) arg.data(), arg.size());
+    }
+}
+
+// @return false on error, errno is set
+static bool write_fd(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t rv = write(fd, data, size);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        size -= (size_t) rv;
+    }
+    return true;
+}
+
+void aof_write(Buffer *batch) {
+    size_t size = buf_size(batch);
+    if (size == 0) {
+        return;
+    }
+    if (!write_fd(g_aof.fd, batch->data_begin, size)) {
+        // losing writes silently is worse than stopping
+        die("write() aof");
+    }
+    if (g_aof.tail_fd >= 0 && !write_fd(g_aof.tail_fd, batch->data_begin, size)) {
+        die("write() aof tail");
+    }
+    if (g_aof.policy == AOF_FSYNC_ALWAYS && fdatasync(g_aof.fd) < 0) {
+        die("fdatasync() aof");
+    }
+    g_aof.size += size;
+    buf_consume(batch, size);
+}
+
+void aof_rewrite_begin() {
+    g_aof.tail_fd = open(aof_tail_path().c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (g_aof.tail_fd < 0) {
+        die("open() aof tail");
+    }
+    g_aof.tail_copied = 0;
+}
+
+int aof_rewrite_open() {
+    return open(aof_rewrite_path().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+}
+
+bool aof_rewrite_catch_up() {
+    if (g_aof.rewrite_fd < 0) {
+        // written by the child, which has exited
+        g_aof.rewrite_fd = open(aof_rewrite_path().c_str(), O_WRONLY | O_APPEND);
+        if (g_aof.rewrite_fd < 0) {
+            msg("open() aof rewrite");
+            return false;
+        }
+    }
+    uint8_t buf[K_AOF_COPY_CHUNK];
+    while (true) {
+        ssize_t rv = pread(g_aof.tail_fd, buf, sizeof(buf), (off_t) g_aof.tail_copied);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return rv == 0;
+        }
+        if (!write_fd(g_aof.rewrite_fd, buf, (size_t) rv)) {
+            msg("write() aof rewrite");
+            return false;
+        }
+        g_aof.tail_copied += (uint64_t) rv;
+    }
+}
+
+bool aof_rewrite_end(bool ok) {
+    ok = ok && aof_rewrite_catch_up();
+    ok = ok && 0 == fdatasync(g_aof.rewrite_fd);
+    ok = ok && 0 == rename(aof_rewrite_path().c_str(), g_aof.path.c_str());
+    // the new file takes the fd of the old one, for the fsync thread
+    if (ok && dup2(g_aof.rewrite_fd, g_aof.fd) < 0) {
+        die("dup2() aof");  // the writes would go to the replaced file
+    }
+    if (ok) {
+        g_aof.size = (uint64_t) lseek(g_aof.fd, 0, SEEK_END);
+    } else {
+        msg("failed to rewrite the AOF");
+        unlink(aof_rewrite_path().c_str());
+    }
+    // after a failure, wait for the AOF to double again
+    g_aof.base_size = g_aof.size.load();
+
+    if (g_aof.rewrite_fd >= 0) {
+        close(g_aof.rewrite_fd);
+        g_aof.rewrite_fd = -1;
+    }
+    close(g_aof.tail_fd);
+    g_aof.tail_fd = -1;
+    unlink(aof_tail_path().c_str());
+    return ok;
+}
+
+bool aof_rewrite_due() {
+    uint64_t size = g_aof.size;
+    return size >= K_AOF_REWRITE_MIN && size >= 2 * g_aof.base_size;
+}
+
+uint64_t aof_size() {
+    return g_aof.size;
+}
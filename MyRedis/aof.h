@@ -0,0 +1,61 @@
+#ifndef _AOF_H
+#define _AOF_H
+
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+#include "buffer.h"
+
+// when the AOF is fsync'd
+enum {
+    AOF_FSYNC_NO = 0,       // left to the kernel
+    AOF_FSYNC_EVERYSEC = 1, // by a background thread, once a second
+    AOF_FSYNC_ALWAYS = 2,   // before the replies of the writes are sent
+};
+
+/**
+ * open the append-only file, and start the fsync thread for everysec.
+ * the event loops share the file, each one appends its own batches.
+*/
+void aof_open(const char *path, uint32_t policy);
+
+bool aof_enabled();
+
+uint32_t aof_policy();
+
+// encode a command in the request format, into a batch of the loop
+void aof_append(Buffer *batch, const std::vector<std::string_view> &cmd);
+
+// write the batch with one write(), and fsync it with AOF_FSYNC_ALWAYS
+void aof_write(Buffer *batch);
+
+/**
+ * the rewrite replaces the log by the commands that recreate the keyspace.
+ * a forked child writes them to `<aof>.rewrite`, meanwhile the batches are
+ * also written to `<aof>.tail`, and once the child is done the tail is
+ * appended to the rewrite, which replaces the AOF.
+*/
+
+// start copying the batches to the tail, with the loops paused for the fork
+void aof_rewrite_begin();
+
+// in the child, create the rewrite file, @return its fd or -1
+int aof_rewrite_open();
+
+// append the tail written so far to the rewrite, while the loops run
+bool aof_rewrite_catch_up();
+
+/**
+ * with the loops paused: if the child succeeded, append the rest of the
+ * tail and replace the AOF by the rewrite, else drop it
+ * @return true if the AOF was replaced
+*/
+bool aof_rewrite_end(bool ok);
+
+// the AOF has doubled since it was opened or rewritten, and it's not small
+bool aof_rewrite_due();
+
+// the bytes of the AOF
+uint64_t aof_size();
+
+#endif
@@ -1,6 +1,6 @@
 #include "avl.h"
 
-static void avl_init(AVLNode *node) {
+void avl_init(AVLNode *node) {
     node->depth = 1;
     node->cnt = 1;
     node->left = node->right = node->parent = NULL;
@@ -74,7 +74,7 @@ static AVLNode *avl_fix_right(AVLNode *root) {
 }
 
 // fix imbalanced nodes and maintain invariants until the root is reached
-static AVLNode *avl_fix(AVLNode *node) {
+AVLNode *avl_fix(AVLNode *node) {
     while (true) {
         avl_update(node);
         uint32_t lHight = avl_depth(node->left);
@@ -137,4 +137,43 @@ AVLNode *avl_del(AVLNode *node) {
             return victim;
         }
     }
-}
\ No newline at end of file
+}
+
+AVLNode *avl_offset(AVLNode *node, int64_t offset) {
+    int64_t pos = 0;    // the rank relative to the starting node
+    while (offset != pos) {
+        if (pos < offset && pos + avl_cnt(node->right) >= offset) {
+            // the target is inside the right subtree
+            node = node->right;
+            pos += avl_cnt(node->left) + 1;
+        } else if (pos > offset && pos - avl_cnt(node->left) <= offset) {
+            // the target is inside the left subtree
+            node = node->left;
+            pos -= avl_cnt(node->right) + 1;
+        } else {
+            // go to the parent
+            AVLNode *parent = node->parent;
+            if (!parent) {
+                return NULL;
+            }
+            if (parent->right == node) {
+                pos -= avl_cnt(node->left) + 1;
+            } else {
+                pos += avl_cnt(node->right) + 1;
+            }
+            node = parent;
+        }
+    }
+    return node;
+}
+
+int64_t avl_rank(AVLNode *node) {
+    int64_t rank = avl_cnt(node->left);
+    while (node->parent) {
+        if (node->parent->right == node) {
+            rank += avl_cnt(node->parent->left) + 1;
+        }
+        node = node->parent;
+    }
+    return rank;
+}
@@ -12,4 +12,27 @@ struct AVLNode {
     AVLNode *parent = NULL;
 };
 
+void avl_init(AVLNode *node);
+
+/**
+ * fix imbalanced nodes from a newly inserted node up to the root
+ * @return the new root
+*/
+AVLNode *avl_fix(AVLNode *node);
+
+/**
+ * detach a node from the tree
+ * @return the new root
+*/
+AVLNode *avl_del(AVLNode *node);
+
+/**
+ * walk to the node `offset` positions away in the sorted order, in O(log n)
+ * @return NULL if out of range
+*/
+AVLNode *avl_offset(AVLNode *node, int64_t offset);
+
+// the position of the node in the sorted order, starting from 0
+int64_t avl_rank(AVLNode *node);
+
 #endif
\ No newline at end of file
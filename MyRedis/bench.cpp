@@ -0,0 +1,369 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <assert.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include "constants.h"
+#include "stats.h"
+#include "utils.h"
+
+// A load generator for the server. Each thread drives its own connections
+// with epoll, every connection keeps a batch of `pipeline` requests in flight,
+// and the latency of each request is recorded into a histogram.
+
+static struct {
+    uint16_t port = 1234;
+    uint32_t nconns = 50;
+    uint32_t nthreads = 1;
+    uint64_t nrequests = 100000;
+    uint32_t pipeline = 1;
+    uint64_t keyspace = 10000;
+    uint32_t vmin = 16;         // value sizes are uniform in [vmin, vmax]
+    uint32_t vmax = 16;
+    uint32_t mix[3] = {80, 20, 0};  // get, set, del
+} g_opt;
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// the latencies are in nanoseconds, 2^5 buckets per power of 2
+// keep them within ~3% at any magnitude
+const uint32_t K_BENCH_SUB_BITS = 5;
+
+// ====== connections ======
+struct BenchConn {
+    int fd = -1;
+    std::vector<uint8_t> wbuf;
+    size_t wpos = 0;            // sent so far
+    std::vector<uint8_t> rbuf;
+    uint64_t batch_start = 0;   // when the requests in flight were sent
+    uint32_t inflight = 0;
+    uint64_t remaining = 0;     // requests left to send
+    bool want_write = false;
+};
+
+struct Worker {
+    std::vector<BenchConn> conns;
+    LatencyHist hist;
+    uint64_t nerrors = 0;
+    uint64_t rng = 0;
+};
+
+static uint64_t rng_next(uint64_t *state) {
+    // splitmix64
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// encode a request like send_req() of client.cpp
+static void append_req(std::vector<uint8_t> &out, const std::string_view *args, uint32_t n) {
+    uint32_t len = 4;
+    for (uint32_t i = 0; i < n; i++) {
+        len += 4 + (uint32_t) args[i].size();
+    }
+    size_t pos = out.size();
+    out.resize(pos + 4 + len);
+    uint8_t *p = &out[pos];
+    memcpy(p, &len, 4);
+    memcpy(p + 4, &n, 4);
+    p += 8;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t sz = (uint32_t) args[i].size();
+        memcpy(p, &sz, 4);
+        memcpy(p + 4, args[i].data(), sz);
+        p += 4 + sz;
+    }
+}
+
+static void gen_req(Worker *w, std::vector<uint8_t> &out, const std::string &values) {
+    char key[32];
+    int klen = snprintf(key, sizeof(key), "key:%lu", rng_next(&w->rng) % g_opt.keyspace);
+    uint32_t total = g_opt.mix[0] + g_opt.mix[1] + g_opt.mix[2];
+    uint32_t pick = (uint32_t) (rng_next(&w->rng) % total);
+    std::string_view args[3];
+    args[1] = std::string_view(key, klen);
+    if (pick < g_opt.mix[0]) {
+        args[0] = "get";
+        append_req(out, args, 2);
+    } else if (pick < g_opt.mix[0] + g_opt.mix[1]) {
+        uint32_t vlen = g_opt.vmin + (uint32_t) (rng_next(&w->rng) % (g_opt.vmax - g_opt.vmin + 1));
+        args[0] = "set";
+        args[2] = std::string_view(values.data(), vlen);
+        append_req(out, args, 3);
+    } else {
+        args[0] = "del";
+        append_req(out, args, 2);
+    }
+}
+
+static void conn_send_batch(Worker *w, BenchConn *conn, const std::string &values) {
+    conn->wbuf.clear();
+    conn->wpos = 0;
+    uint32_t n = (uint32_t) std::min<uint64_t>(g_opt.pipeline, conn->remaining);
+    for (uint32_t i = 0; i < n; i++) {
+        gen_req(w, conn->wbuf, values);
+    }
+    conn->remaining -= n;
+    conn->inflight = n;
+    conn->batch_start = get_monotonic_nsec();
+}
+
+// @return false on error
+static bool conn_write(BenchConn *conn) {
+    while (conn->wpos < conn->wbuf.size()) {
+        ssize_t rv = write(conn->fd, &conn->wbuf[conn->wpos], conn->wbuf.size() - conn->wpos);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            return true;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        conn->wpos += (size_t) rv;
+    }
+    return true;
+}
+
+static void conn_set_events(int epfd, BenchConn *conn, bool want_write) {
+    if (conn->want_write == want_write) {
+        return;
+    }
+    conn->want_write = want_write;
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | (want_write ? (uint32_t) EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// consume the complete responses
+// @return false on error
+static bool conn_read(Worker *w, BenchConn *conn) {
+    uint8_t buf[64 * 1024];
+    while (true) {
+        ssize_t rv = read(conn->fd, buf, sizeof(buf));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        conn->rbuf.insert(conn->rbuf.end(), buf, buf + rv);
+        if ((size_t) rv < sizeof(buf)) {
+            break;
+        }
+    }
+
+    uint64_t now = get_monotonic_nsec();
+    size_t pos = 0;
+    while (conn->rbuf.size() - pos >= 4) {
+        uint32_t len = 0;
+        memcpy(&len, &conn->rbuf[pos], 4);
+        if (conn->rbuf.size() - pos - 4 < len) {
+            break;
+        }
+        if (conn->inflight == 0) {
+            return false;   // unexpected response
+        }
+        if (len > 0 && conn->rbuf[pos + 4] == SER_ERR) {
+            w->nerrors++;
+        }
+        hist_add(&w->hist, now - conn->batch_start);
+        conn->inflight--;
+        pos += 4 + len;
+    }
+    conn->rbuf.erase(conn->rbuf.begin(), conn->rbuf.begin() + pos);
+    return true;
+}
+
+static int bench_connect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(g_opt.port);
+    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK); // 127.0.0.1
+    if (connect(fd, (const struct sockaddr *) &addr, sizeof(addr))) {
+        die("connect");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static void worker_run(Worker *w, const std::string *values) {
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        die("epoll_create1()");
+    }
+    size_t nactive = 0;
+    for (BenchConn &conn : w->conns) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &conn;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conn.fd, &ev);
+        if (conn.remaining == 0) {
+            continue;
+        }
+        nactive++;
+        conn_send_batch(w, &conn, *values);
+        if (!conn_write(&conn)) {
+            die("write()");
+        }
+        conn_set_events(epfd, &conn, conn.wpos < conn.wbuf.size());
+    }
+
+    std::vector<struct epoll_event> events(w->conns.size() + 1);
+    while (nactive > 0) {
+        int n = epoll_wait(epfd, events.data(), (int) events.size(), -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            die("epoll_wait()");
+        }
+        for (int i = 0; i < n; i++) {
+            BenchConn *conn = (BenchConn *) events[i].data.ptr;
+            if ((events[i].events & EPOLLOUT) && !conn_write(conn)) {
+                die("write()");
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !conn_read(w, conn)) {
+                die("read(), the server closed the connection");
+            }
+            if (conn->inflight == 0 && conn->wpos == conn->wbuf.size()) {
+                if (conn->remaining == 0) {
+                    nactive--;
+                    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                    continue;
+                }
+                conn_send_batch(w, conn, *values);
+                if (!conn_write(conn)) {
+                    die("write()");
+                }
+            }
+            conn_set_events(epfd, conn, conn->wpos < conn->wbuf.size());
+        }
+    }
+    close(epfd);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "usage: %s [-p port] [-c connections] [-t threads] [-n requests] [-P pipeline]\n"
+        "    [-r keyspace] [-d value-size | -d min-max] [--mix get:set:del]\n", prog);
+    exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        const char *val = argv[++i];
+        if (0 == strcmp(arg, "-p")) {
+            g_opt.port = (uint16_t) atoi(val);
+        } else if (0 == strcmp(arg, "-c")) {
+            g_opt.nconns = (uint32_t) atoi(val);
+        } else if (0 == strcmp(arg, "-t")) {
+            g_opt.nthreads = (uint32_t) atoi(val);
+        } else if (0 == strcmp(arg, "-n")) {
+            g_opt.nrequests = strtoull(val, NULL, 10);
+        } else if (0 == strcmp(arg, "-P")) {
+            g_opt.pipeline = (uint32_t) atoi(val);
+        } else if (0 == strcmp(arg, "-r")) {
+            g_opt.keyspace = strtoull(val, NULL, 10);
+        } else if (0 == strcmp(arg, "-d")) {
+            if (2 != sscanf(val, "%u-%u", &g_opt.vmin, &g_opt.vmax)) {
+                g_opt.vmin = g_opt.vmax = (uint32_t) atoi(val);
+            }
+        } else if (0 == strcmp(arg, "--mix")) {
+            if (3 != sscanf(val, "%u:%u:%u", &g_opt.mix[0], &g_opt.mix[1], &g_opt.mix[2])) {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (g_opt.nconns < 1 || g_opt.nthreads < 1 || g_opt.pipeline < 1 || g_opt.keyspace < 1
+        || g_opt.vmin > g_opt.vmax || g_opt.vmax > K_MAX_MSG / 2
+        || g_opt.mix[0] + g_opt.mix[1] + g_opt.mix[2] == 0) {
+        usage(argv[0]);
+    }
+    if (g_opt.nthreads > g_opt.nconns) {
+        g_opt.nthreads = g_opt.nconns;
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_args(argc, argv);
+    std::string values(g_opt.vmax, 'x');
+
+    // spread the connections and the requests evenly
+    std::vector<Worker> workers(g_opt.nthreads);
+    for (uint32_t i = 0; i < g_opt.nconns; i++) {
+        Worker &w = workers[i % g_opt.nthreads];
+        BenchConn conn;
+        conn.fd = bench_connect();
+        conn.remaining = g_opt.nrequests / g_opt.nconns + (i < g_opt.nrequests % g_opt.nconns);
+        w.conns.push_back(std::move(conn));
+    }
+    for (uint32_t i = 0; i < g_opt.nthreads; i++) {
+        workers[i].rng = i + 1;
+        workers[i].hist.sub_bits = K_BENCH_SUB_BITS;
+    }
+
+    uint64_t start = get_monotonic_nsec();
+    std::vector<std::thread> threads;
+    for (Worker &w : workers) {
+        threads.emplace_back(worker_run, &w, &values);
+    }
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    double secs = (double) (get_monotonic_nsec() - start) / 1e9;
+
+    LatencyHist hist;
+    hist.sub_bits = K_BENCH_SUB_BITS;
+    uint64_t nerrors = 0;
+    for (Worker &w : workers) {
+        hist_merge(&hist, &w.hist);
+        nerrors += w.nerrors;
+        for (BenchConn &conn : w.conns) {
+            close(conn.fd);
+        }
+    }
+
+    printf("%lu requests in %.2f s, %u connections, %u threads, pipeline %u\n",
+        hist.total, secs, g_opt.nconns, g_opt.nthreads, g_opt.pipeline);
+    printf("throughput: %.0f ops/sec\n", (double) hist.total / secs);
+    printf("errors: %lu\n", nerrors);
+    printf("latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+        hist_percentile(&hist, 50) / 1e3, hist_percentile(&hist, 99) / 1e3,
+        hist_percentile(&hist, 99.9) / 1e3, hist.max / 1e3);
+    return 0;
+}
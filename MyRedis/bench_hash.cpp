@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include "utils.h"
+
+// the previous str_hash(): 32-bit FNV, one byte at a time
+static uint64_t fnv_hash(const uint8_t *data, size_t len) {
+    uint32_t h = 0x811C9DC5;
+    for (size_t i = 0; i < len; i++) {
+        h = (h + data[i]) * 0x01000193;
+    }
+    return h;
+}
+
+static uint64_t get_monotonic_ns() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// the average time of hashing `len` bytes
+static double bench_speed(uint64_t (*hash)(const uint8_t *, size_t), size_t len) {
+    std::vector<uint8_t> buf(len + 64);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = (uint8_t) rand();
+    }
+    size_t rounds = (64 << 20) / (len + 16);
+    uint64_t sink = 0;
+    uint64_t start = get_monotonic_ns();
+    for (size_t i = 0; i < rounds; i++) {
+        // vary the offset so the loop is not optimized away
+        sink += hash(&buf[i & 63], len);
+    }
+    uint64_t elapsed = get_monotonic_ns() - start;
+    if (sink == 42) {
+        printf(" ");
+    }
+    return (double) elapsed / (double) rounds;
+}
+
+/**
+ * hash keys like "key:123" into 2^bits buckets by the low bits,
+ * as the HMap does, and compare the collisions with a uniform hash.
+ * @return the ratio of the observed and the expected number of collisions
+*/
+static double bench_collisions(uint64_t (*hash)(const uint8_t *, size_t), uint32_t bits) {
+    size_t nkeys = (size_t) 1 << bits;
+    std::vector<uint8_t> used(nkeys, 0);
+    size_t collisions = 0;
+    char key[32];
+    for (size_t i = 0; i < nkeys; i++) {
+        int len = snprintf(key, sizeof(key), "key:%zu", i);
+        size_t pos = hash((const uint8_t *) key, (size_t) len) & (nkeys - 1);
+        collisions += used[pos];
+        used[pos] = 1;
+    }
+    // n keys into n buckets leave n/e buckets empty
+    double expected = (double) nkeys / 2.718281828;
+    return (double) collisions / expected;
+}
+
+int main() {
+    const size_t sizes[] = {4, 8, 16, 32, 64, 128, 256, 1024, 4096, 65536};
+    printf("%8s %12s %12s %12s\n", "bytes", "fnv ns", "str_hash ns", "str_hash GB/s");
+    for (size_t len : sizes) {
+        double t_old = bench_speed(&fnv_hash, len);
+        double t_new = bench_speed(&str_hash, len);
+        printf("%8zu %12.2f %12.2f %12.2f\n", len, t_old, t_new, (double) len / t_new);
+    }
+
+    printf("\ncollisions relative to a uniform hash, sequential keys\n");
+    printf("%8s %12s %12s\n", "buckets", "fnv", "str_hash");
+    for (uint32_t bits = 16; bits <= 24; bits += 4) {
+        printf("%8s%-4u %11.3f %12.3f\n", "2^", bits,
+            bench_collisions(&fnv_hash, bits), bench_collisions(&str_hash, bits));
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "hashtable.h"
+#include "stats.h"
+#include "utils.h"
+
+// the throughput and the worst single-op latency of the HMap,
+// from 1K keys up to the size given on the command line.
+// build it with the implementation under test, see `make bench_hmap`.
+
+struct Data {
+    HNode node;
+    uint64_t key = 0;
+};
+
+static bool data_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Data, node)->key == container_of(rhs, Data, node)->key;
+}
+
+static uint64_t get_monotonic_ns() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+static uint64_t g_rng = 1;
+
+static uint64_t rng_next() {
+    // splitmix64
+    uint64_t z = (g_rng += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static void data_init(Data *data, uint64_t key) {
+    data->key = key;
+    data->node.hcode = str_hash((const uint8_t *) &key, sizeof(key));
+}
+
+struct Result {
+    double ns_per_op = 0;
+    uint64_t max_ns = 0;
+};
+
+// every op is timed with the TSC, the overhead is a few ns per op
+template <class F>
+static Result measure(size_t nops, F op) {
+    uint64_t max_ticks = 0;
+    uint64_t start = get_monotonic_ns();
+    for (size_t i = 0; i < nops; i++) {
+        uint64_t t0 = ticks_now();
+        op(i);
+        uint64_t ticks = ticks_now() - t0;
+        max_ticks = std::max(max_ticks, ticks);
+    }
+    Result res;
+    res.ns_per_op = (double) (get_monotonic_ns() - start) / (double) nops;
+    res.max_ns = ticks_to_nsec(max_ticks);
+    return res;
+}
+
+static void print_result(const Result &res) {
+    printf(" %8.1f %9.1f", res.ns_per_op, (double) res.max_ns / 1e3);
+}
+
+static void bench_size(size_t nkeys) {
+    std::vector<Data> nodes(nkeys);
+    for (size_t i = 0; i < nkeys; i++) {
+        data_init(&nodes[i], i);
+    }
+    // insert in a random order
+    std::vector<uint32_t> order(nkeys);
+    for (size_t i = 0; i < nkeys; i++) {
+        order[i] = (uint32_t) i;
+    }
+    for (size_t i = nkeys; i > 1; i--) {
+        std::swap(order[i - 1], order[rng_next() % i]);
+    }
+
+    HMap hmap;
+    printf("%10zu", nkeys);
+    print_result(measure(nkeys, [&](size_t i) {
+        hm_insert(&hmap, &nodes[order[i]].node);
+    }));
+
+    // lookups with 100%, 50% and 0% of hits, the missing keys are >= nkeys
+    const size_t nlookups = 1000000;
+    std::vector<Data> probes(nlookups);
+    uint64_t found = 0;
+    for (uint32_t hit_pct : {100, 50, 0}) {
+        for (size_t i = 0; i < nlookups; i++) {
+            bool hit = rng_next() % 100 < hit_pct;
+            data_init(&probes[i], hit ? rng_next() % nkeys : nkeys + rng_next() % nkeys);
+        }
+        print_result(measure(nlookups, [&](size_t i) {
+            found += hm_lookup(&hmap, &probes[i].node, &data_eq) != NULL;
+        }));
+    }
+
+    print_result(measure(nkeys, [&](size_t i) {
+        hm_pop(&hmap, &nodes[order[nkeys - 1 - i]].node, &data_eq);
+    }));
+    printf("\n");
+    if (found == 42) {
+        printf(" ");    // so the lookups are not optimized away
+    }
+    hm_destroy(&hmap);
+}
+
+int main(int argc, char **argv) {
+    // 100M keys take about 3 GB
+    size_t max_keys = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    str_hash_seed(1);
+    ticks_init();
+    printf("ns/op and the worst op in us\n");
+    printf("%10s %18s %18s %18s %18s %18s\n",
+        "keys", "insert", "lookup 100% hit", "lookup 50% hit", "lookup 0% hit", "pop");
+    for (size_t nkeys = 1000; nkeys <= max_keys; nkeys *= 10) {
+        bench_size(nkeys);
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "utils.h"
+
+const size_t K_BUF_MIN_CAP = 256;
+
+void buf_reserve(Buffer *buf, size_t n) {
+    if (buf_tail_room(buf) >= n) {
+        return;
+    }
+
+    size_t size = buf_size(buf);
+    size_t cap = buf_cap(buf);
+    if (size + n <= cap && size <= cap / 2) {
+        // move the data to the front, the cost is paid by the consumed bytes
+        memmove(buf->buf_begin, buf->data_begin, size);
+        buf->data_begin = buf->buf_begin;
+        buf->data_end = buf->data_begin + size;
+        return;
+    }
+
+    // grow by doubling, only the live data is copied
+    size_t new_cap = cap < K_BUF_MIN_CAP ? K_BUF_MIN_CAP : cap;
+    while (new_cap < size + n) {
+        new_cap *= 2;
+    }
+    uint8_t *mem = (uint8_t *) malloc(new_cap);
+    if (!mem) {
+        die("out of memory");
+    }
+    if (size > 0) {
+        memcpy(mem, buf->data_begin, size);
+    }
+    free(buf->buf_begin);
+    buf->buf_begin = buf->data_begin = mem;
+    buf->data_end = mem + size;
+    buf->buf_end = mem + new_cap;
+}
+
+void buf_append(Buffer *buf, const uint8_t *data, size_t len) {
+    buf_reserve(buf, len);
+    memcpy(buf->data_end, data, len);
+    buf->data_end += len;
+}
+
+void buf_consume(Buffer *buf, size_t n) {
+    assert(n <= buf_size(buf));
+    buf->data_begin += n;
+    if (buf->data_begin == buf->data_end) {
+        // empty, rewind for free
+        buf->data_begin = buf->data_end = buf->buf_begin;
+    }
+}
+
+void buf_shrink(Buffer *buf, size_t keep) {
+    if (buf_size(buf) == 0 && buf_cap(buf) > keep) {
+        buf_free(buf);
+    }
+}
+
+void buf_free(Buffer *buf) {
+    free(buf->buf_begin);
+    *buf = Buffer{};
+}
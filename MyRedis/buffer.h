@@ -0,0 +1,68 @@
+#ifndef _BUFFER_H
+#define _BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * a byte buffer that grows on demand.
+ * data is consumed from the front by advancing an offset,
+ * the free space in the front is reclaimed only when appending needs it.
+ * +-----------+---------------+--------------+
+ * |  consumed |      data     |  free space  |
+ * +-----------+---------------+--------------+
+ * buf_begin   data_begin      data_end       buf_end
+*/
+struct Buffer {
+    uint8_t *buf_begin = NULL;
+    uint8_t *buf_end = NULL;
+    uint8_t *data_begin = NULL;
+    uint8_t *data_end = NULL;
+};
+
+inline size_t buf_size(const Buffer *buf) {
+    return (size_t) (buf->data_end - buf->data_begin);
+}
+
+inline size_t buf_cap(const Buffer *buf) {
+    return (size_t) (buf->buf_end - buf->buf_begin);
+}
+
+// the free space after the data
+inline size_t buf_tail_room(const Buffer *buf) {
+    return (size_t) (buf->buf_end - buf->data_end);
+}
+
+// make sure there are at least n bytes of free space after the data
+void buf_reserve(Buffer *buf, size_t n);
+
+void buf_append(Buffer *buf, const uint8_t *data, size_t len);
+
+inline void buf_append_u8(Buffer *buf, uint8_t val) {
+    buf_append(buf, &val, 1);
+}
+
+inline void buf_append_u32(Buffer *buf, uint32_t val) {
+    buf_append(buf, (const uint8_t *) &val, 4);
+}
+
+inline void buf_append_i64(Buffer *buf, int64_t val) {
+    buf_append(buf, (const uint8_t *) &val, 8);
+}
+
+// drop the data after the first n bytes
+inline void buf_truncate(Buffer *buf, size_t n) {
+    if (n < buf_size(buf)) {
+        buf->data_end = buf->data_begin + n;
+    }
+}
+
+// remove n bytes from the front
+void buf_consume(Buffer *buf, size_t n);
+
+// release the memory of an empty buffer if it is larger than `keep`
+void buf_shrink(Buffer *buf, size_t keep);
+
+void buf_free(Buffer *buf);
+
+#endif
@@ -51,21 +51,21 @@ static int32_t send_req(int fd, const std::vector<std::string> &cmd) {
     for (const std::string &s: cmd) {
         len += s.size() + 4;
     }
-    if (len > K_MAX_ARGS) {
+    if (len > K_MAX_MSG || n > K_MAX_ARGS) {
         return -1;
     }
 
-    char wbuf[4 + K_MAX_MSG];
-    memcpy(wbuf, &len, 4);
-    memcpy(wbuf + 4, &n, 4);
+    std::vector<char> wbuf(4 + len);
+    memcpy(&wbuf[0], &len, 4);
+    memcpy(&wbuf[4], &n, 4);
     size_t cur = 8;
     for (const std::string &s : cmd) {
         uint32_t p = (uint32_t) s.size();
-        memcpy(wbuf + cur, &p, 4);
-        memcpy(wbuf + cur + 4, s.data(), s.size());
+        memcpy(&wbuf[cur], &p, 4);
+        memcpy(&wbuf[cur + 4], s.data(), s.size());
         cur += 4 + s.size();
     }
-    return write_all(fd, wbuf, len + 4);
+    return write_all(fd, wbuf.data(), len + 4);
 }
 
 static int32_t on_response(const uint8_t *data, size_t size) {
@@ -122,6 +122,18 @@ static int32_t on_response(const uint8_t *data, size_t size) {
             printf("(int) %ld\n", val);
             return 1 + 8;  
         }
+
+    case SER_DBL:
+        if (size < 1 + 8) {
+            msg("bad response");
+            return -1;
+        }
+        {
+            double val = 0;
+            memcpy(&val, data + 1, 8);
+            printf("(dbl) %g\n", val);
+            return 1 + 8;
+        }
         
     case SER_ARR:
         if (size < 1 + 4) {
@@ -145,14 +157,14 @@ static int32_t on_response(const uint8_t *data, size_t size) {
         }
     default:
         msg("bad response");
-        break;
+        return -1;
     }
 }
 
 static int32_t read_res(int fd) {
-    char rbuf[4 + K_MAX_MSG + 1];
+    std::vector<char> rbuf(4);
     errno = 0;
-    int32_t err = read_full(fd, rbuf, 4);
+    int32_t err = read_full(fd, rbuf.data(), 4);
     if (err) {
         if (errno == 0) {
             msg("EOF");
@@ -163,13 +175,14 @@ static int32_t read_res(int fd) {
     }
 
     uint32_t len = 0;
-    memcpy(&len, rbuf, 4);
+    memcpy(&len, rbuf.data(), 4);
     if (len > K_MAX_MSG) {
         msg("too long");
         return -1;
     }
 
     // reply body
+    rbuf.resize(4 + len);
     err = read_full(fd, &rbuf[4], len);
     if (err) {
         msg("read() error");
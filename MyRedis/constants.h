@@ -2,7 +2,7 @@
 #define _CONSTANTS_H
 
 #include <stdio.h>
-const size_t K_MAX_MSG = 4096;
+const size_t K_MAX_MSG = 32 << 20;
 
 const size_t K_MAX_ARGS = 1024;
 
@@ -10,6 +10,7 @@ enum {
     STATE_REQ = 0,  // reading request
     STATE_RES = 1,  // sending response
     STATE_END = 2,
+    STATE_WAIT = 3, // waiting for the reply of a command forwarded to another loop
 };
 
 enum {
@@ -24,10 +25,14 @@ enum {
     SER_STR = 2, // A string
     SER_INT = 3, // A int64
     SER_ARR = 4, // Array
+    SER_DBL = 5, // A double
 };
 
 enum {
     ERR_UNKNOWN = 1,
     ERR_2BIG = 2,
+    ERR_TYPE = 3,   // the key holds another type
+    ERR_ARG = 4,    // a malformed argument
+    ERR_OOM = 5,    // over maxmemory and nothing to evict
 };
 #endif
\ No newline at end of file
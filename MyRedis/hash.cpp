@@ -0,0 +1,260 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "hash.h"
+#include "utils.h"
+
+// A small hash is packed like the listpack of redis: one malloc'd buffer
+// of records, searched linearly.
+// +------+-------+------+-------+------+-----
+// | flen | field | vlen | value | flen | ...
+// +------+-------+------+-------+------+-----
+// The lengths are 1 byte. A field costs 2 bytes over its data, instead of
+// a node and a hashtable slot, and a lookup reads one contiguous buffer.
+
+static_assert(K_HASH_SMALL_LEN <= UINT8_MAX, "the pack lengths are 1 byte");
+
+static std::string_view pack_field(Hash *hash, uint32_t pos) {
+    return std::string_view((const char *) &hash->pack[pos + 1], hash->pack[pos]);
+}
+
+static std::string_view pack_val(Hash *hash, uint32_t pos) {
+    uint32_t vpos = pos + 1 + hash->pack[pos];
+    return std::string_view((const char *) &hash->pack[vpos + 1], hash->pack[vpos]);
+}
+
+static uint32_t pack_record_len(Hash *hash, uint32_t pos) {
+    return 2 + (uint32_t) pack_field(hash, pos).size() + (uint32_t) pack_val(hash, pos).size();
+}
+
+// @return the position of the record of the field, pack_len if not found
+static uint32_t pack_find(Hash *hash, std::string_view field) {
+    uint32_t pos = 0;
+    while (pos < hash->pack_len && pack_field(hash, pos) != field) {
+        pos += pack_record_len(hash, pos);
+    }
+    return pos;
+}
+
+// resize the `old` bytes at `pos` to `len` bytes, and move the records after them
+static uint8_t *pack_splice(Hash *hash, uint32_t pos, uint32_t old, uint32_t len) {
+    uint32_t total = hash->pack_len - old + len;
+    uint32_t tail = hash->pack_len - pos - old;
+    if (len > old) {
+        hash->pack = (uint8_t *) realloc(hash->pack, total);
+        assert(hash->pack);
+    }
+    memmove(&hash->pack[pos + len], &hash->pack[pos + old], tail);
+    if (total == 0) {
+        free(hash->pack);
+        hash->pack = NULL;
+    } else if (len < old) {
+        hash->pack = (uint8_t *) realloc(hash->pack, total);
+        assert(hash->pack);
+    }
+    hash->pack_len = total;
+    return hash->pack ? &hash->pack[pos] : NULL;
+}
+
+static void pack_write(uint8_t *dst, std::string_view field, std::string_view val) {
+    dst[0] = (uint8_t) field.size();
+    memcpy(&dst[1], field.data(), field.size());
+    dst += 1 + field.size();
+    dst[0] = (uint8_t) val.size();
+    memcpy(&dst[1], val.data(), val.size());
+}
+
+static HashNode *hnode_new(std::string_view field, std::string_view val) {
+    HashNode *node = (HashNode *) malloc(sizeof(HashNode) + field.size() + val.size());
+    assert(node);
+    node->hmap.hcode = str_hash((const uint8_t *) field.data(), field.size());
+#ifndef HMAP_SWISS
+    node->hmap.next = NULL;
+#endif
+    node->flen = (uint32_t) field.size();
+    node->vlen = (uint32_t) val.size();
+    memcpy(&node->data[0], field.data(), field.size());
+    memcpy(&node->data[field.size()], val.data(), val.size());
+    return node;
+}
+
+static std::string_view hnode_field(HashNode *node) {
+    return std::string_view(node->data, node->flen);
+}
+
+static std::string_view hnode_val(HashNode *node) {
+    return std::string_view(node->data + node->flen, node->vlen);
+}
+
+static size_t hnode_mem(HashNode *node) {
+    return sizeof(HashNode) + node->flen + node->vlen;
+}
+
+// a field to look up in the hashtable
+struct HKey {
+    HNode node;
+    std::string_view field;
+};
+
+static bool hcmp(HNode *node, HNode *key) {
+    HashNode *hnode = container_of(node, HashNode, hmap);
+    HKey *hkey = container_of(key, HKey, node);
+    return node->hcode == key->hcode && hnode_field(hnode) == hkey->field;
+}
+
+static void hkey_init(HKey *key, std::string_view field) {
+    key->node.hcode = str_hash((const uint8_t *) field.data(), field.size());
+    key->field = field;
+}
+
+static void hnode_insert(Hash *hash, std::string_view field, std::string_view val) {
+    HashNode *node = hnode_new(field, val);
+    hash->node_bytes += hnode_mem(node);
+    hm_insert(&hash->hmap, &node->hmap);
+}
+
+static void hnode_del(Hash *hash, HashNode *node) {
+    hash->node_bytes -= hnode_mem(node);
+    free(node);
+}
+
+// move the records to the hashtable
+static void hash_convert(Hash *hash) {
+    for (uint32_t pos = 0; pos < hash->pack_len; pos += pack_record_len(hash, pos)) {
+        hnode_insert(hash, pack_field(hash, pos), pack_val(hash, pos));
+    }
+    free(hash->pack);
+    hash->pack = NULL;
+    hash->pack_len = hash->pack_size = 0;
+    hash->large = true;
+}
+
+bool hash_set(Hash *hash, std::string_view field, std::string_view val) {
+    if (!hash->large && (field.size() > K_HASH_SMALL_LEN || val.size() > K_HASH_SMALL_LEN)) {
+        hash_convert(hash);
+    }
+    if (!hash->large) {
+        uint32_t pos = pack_find(hash, field);
+        bool added = pos == hash->pack_len;
+        if (added && hash->pack_size + 1 > K_HASH_SMALL_FIELDS) {
+            hash_convert(hash);
+            return hash_set(hash, field, val);
+        }
+        uint32_t old = added ? 0 : pack_record_len(hash, pos);
+        uint32_t len = 2 + (uint32_t) (field.size() + val.size());
+        pack_write(pack_splice(hash, pos, old, len), field, val);
+        hash->pack_size += added ? 1 : 0;
+        return added;
+    }
+
+    HKey key;
+    hkey_init(&key, field);
+    HNode *found = hm_lookup(&hash->hmap, &key.node, &hcmp);
+    if (found) {
+        HashNode *node = container_of(found, HashNode, hmap);
+        if (node->vlen == val.size()) {
+            memcpy(node->data + node->flen, val.data(), val.size());
+            return false;
+        }
+        // the value is stored in the node, a new size takes a new node
+        hm_pop(&hash->hmap, &key.node, &hcmp);
+        hnode_del(hash, node);
+    }
+    hnode_insert(hash, field, val);
+    return !found;
+}
+
+bool hash_get(Hash *hash, std::string_view field, std::string_view &val) {
+    if (!hash->large) {
+        uint32_t pos = pack_find(hash, field);
+        if (pos == hash->pack_len) {
+            return false;
+        }
+        val = pack_val(hash, pos);
+        return true;
+    }
+    HKey key;
+    hkey_init(&key, field);
+    HNode *found = hm_lookup(&hash->hmap, &key.node, &hcmp);
+    if (!found) {
+        return false;
+    }
+    val = hnode_val(container_of(found, HashNode, hmap));
+    return true;
+}
+
+bool hash_del(Hash *hash, std::string_view field) {
+    if (!hash->large) {
+        uint32_t pos = pack_find(hash, field);
+        if (pos == hash->pack_len) {
+            return false;
+        }
+        pack_splice(hash, pos, pack_record_len(hash, pos), 0);
+        hash->pack_size--;
+        return true;
+    }
+    HKey key;
+    hkey_init(&key, field);
+    HNode *found = hm_pop(&hash->hmap, &key.node, &hcmp);
+    if (!found) {
+        return false;
+    }
+    hnode_del(hash, container_of(found, HashNode, hmap));
+    return true;
+}
+
+size_t hash_size(Hash *hash) {
+    return hash->large ? hm_size(&hash->hmap) : hash->pack_size;
+}
+
+struct ForeachCtx {
+    void (*f)(std::string_view field, std::string_view val, void *arg) = NULL;
+    void *arg = NULL;
+};
+
+static void cb_foreach(HNode *node, void *arg) {
+    ForeachCtx *ctx = (ForeachCtx *) arg;
+    HashNode *hnode = container_of(node, HashNode, hmap);
+    ctx->f(hnode_field(hnode), hnode_val(hnode), ctx->arg);
+}
+
+void hash_foreach(Hash *hash,
+    void (*f)(std::string_view field, std::string_view val, void *arg), void *arg) {
+    if (!hash->large) {
+        for (uint32_t pos = 0; pos < hash->pack_len; pos += pack_record_len(hash, pos)) {
+            f(pack_field(hash, pos), pack_val(hash, pos), arg);
+        }
+        return;
+    }
+    ForeachCtx ctx;
+    ctx.f = f;
+    ctx.arg = arg;
+    hm_foreach(&hash->hmap, &cb_foreach, &ctx);
+}
+
+static void cb_collect(HNode *node, void *arg) {
+    ((std::vector<HNode *> *) arg)->push_back(node);
+}
+
+static bool hcmp_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+void hash_dispose(Hash *hash) {
+    free(hash->pack);
+    hash->pack = NULL;
+    hash->pack_len = hash->pack_size = 0;
+    // the nodes are popped after the iteration, it follows the chains
+    std::vector<HNode *> nodes;
+    hm_foreach(&hash->hmap, &cb_collect, &nodes);
+    for (HNode *node : nodes) {
+        hm_pop(&hash->hmap, node, &hcmp_same);
+        hnode_del(hash, container_of(node, HashNode, hmap));
+    }
+    hm_destroy(&hash->hmap);
+}
+
+size_t hash_mem(Hash *hash) {
+    return sizeof(Hash) + hash->pack_len + hash->node_bytes + hm_stats(&hash->hmap).bytes;
+}
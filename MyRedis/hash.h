@@ -0,0 +1,63 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include "hashtable.h"
+
+// a hash stays small while it has at most this many fields,
+// and its fields and values are at most this long
+const size_t K_HASH_SMALL_FIELDS = 128;
+const size_t K_HASH_SMALL_LEN = 64;
+
+/**
+ * hash of fields.
+ * a small hash is packed in one buffer of records, see hash.cpp,
+ * a large one is a hashtable of nodes. a small hash is converted
+ * once it outgrows the limits above, and stays large.
+*/
+struct Hash {
+    uint8_t *pack = NULL;   // the records of a small hash
+    uint32_t pack_len = 0;  // the bytes of the records
+    uint32_t pack_size = 0; // the number of records
+    bool large = false;
+    HMap hmap;              // the fields of a large hash
+    size_t node_bytes = 0;  // the allocations of the fields
+};
+
+struct HashNode {
+    HNode hmap;
+    uint32_t flen = 0;
+    uint32_t vlen = 0;
+    char data[];            // the field, then the value
+};
+
+/**
+ * set the value of a field
+ * @return true if the field is new
+*/
+bool hash_set(Hash *hash, std::string_view field, std::string_view val);
+
+/**
+ * look up a field, the value is valid until the hash is changed
+ * @return false if there is no such field
+*/
+bool hash_get(Hash *hash, std::string_view field, std::string_view &val);
+
+// @return true if the field was removed
+bool hash_del(Hash *hash, std::string_view field);
+
+size_t hash_size(Hash *hash);
+
+// call f on every field and its value
+void hash_foreach(Hash *hash,
+    void (*f)(std::string_view field, std::string_view val, void *arg), void *arg);
+
+// free all the fields
+void hash_dispose(Hash *hash);
+
+// the bytes used by the hash, the records or the fields and the hashtable
+size_t hash_mem(Hash *hash);
+
+#endif
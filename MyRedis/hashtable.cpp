@@ -1,13 +1,26 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <utility>
 #include "hashtable.h"
+#include "utils.h"
+
+static size_t h_bytes(HTab *htab) {
+    return (htab->mask + 1) * sizeof(HNode *);
+}
 
 // n must be a power of 2
 static void h_init(HTab *htab, size_t n) {
     assert(n > 0 && ((n - 1) & n) == 0);
-    htab->tab = (HNode **) calloc(sizeof(HNode *), n);
+    htab->tab = NULL;
     htab->mask = n - 1;
     htab->size = 0;
+    htab->tab = (HNode **) table_alloc(h_bytes(htab));
+}
+
+static void h_free(HTab *htab) {
+    table_free(htab->tab, h_bytes(htab));
+    *htab = HTab{};
 }
 
 // hashtable insertion
@@ -51,36 +64,51 @@ static HNode *h_detach(HTab *htab, HNode **from) {
 }
 
 const size_t K_RESIZING_WORK = 128;
+const size_t K_PREFAULT_BYTES = 256 << 10;
+
+// fault in the next part of a new large table, so that the inserts
+// don't all stall on the page faults right after the resizing starts
+static void hm_prefault(HMap *hmap) {
+    size_t total = h_bytes(&hmap->ht1);
+    if (total < K_TABLE_MMAP_BYTES || hmap->prefault_pos >= total) {
+        return;
+    }
+    size_t n = std::min(K_PREFAULT_BYTES, total - hmap->prefault_pos);
+    table_prefault((uint8_t *) hmap->ht1.tab + hmap->prefault_pos, n);
+    hmap->prefault_pos += n;
+}
 
-static void hm_help_resizing(HMap *hmap) {
+// move up to `max_work` units from ht2 to ht1.
+// a moved node or a visited bucket is a unit of work,
+// so a run of empty buckets doesn't make it unbounded.
+static void hm_help_resizing(HMap *hmap, size_t max_work) {
     if (hmap->ht2.tab == NULL) {
         return;
     }
+    hm_prefault(hmap);
 
     size_t nwork = 0;
-    while (nwork < K_RESIZING_WORK && hmap->ht2.size > 0) {
+    while (nwork < max_work && hmap->ht2.size > 0) {
         // scan for nodes from ht2 and move them to ht1
         HNode **from = &hmap->ht2.tab[hmap->resizing_pos];
+        nwork++;
         if (*from == NULL) {
             hmap->resizing_pos++;
             continue;
         }
 
         h_insert(&hmap->ht1, h_detach(&hmap->ht2, from));
-        nwork++;
     }
 
     if (hmap->ht2.size == 0) {
         // done
-        free(hmap->ht2.tab);
-        hmap->ht2 = HTab{};
+        h_free(&hmap->ht2);
     }
 }
 
-
 HNode *hm_lookup(HMap *hmap, HNode *key,
     bool (*cmp)(HNode *, HNode *)) {
-    hm_help_resizing(hmap);
+    hm_help_resizing(hmap, K_RESIZING_WORK);
     HNode **from = h_look_up(&hmap->ht1, key, cmp);
     if (from == NULL) {
         from = h_look_up(&hmap->ht2, key, cmp);
@@ -91,19 +119,41 @@ HNode *hm_lookup(HMap *hmap, HNode *key,
     return *from;
 }
 
+void hm_prefetch(HMap *hmap, uint64_t hcode) {
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2}) {
+        if (htab->tab) {
+            __builtin_prefetch(&htab->tab[hcode & htab->mask]);
+        }
+    }
+}
+
+// the head of the chain, it's the node looked for unless there are collisions
+void hm_prefetch_node(HMap *hmap, uint64_t hcode) {
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2}) {
+        if (htab->tab) {
+            HNode *node = htab->tab[hcode & htab->mask];
+            if (node) {
+                __builtin_prefetch(node);
+            }
+        }
+    }
+}
+
 const size_t K_MAX_LOAD_FACTOR = 8;
+const size_t K_MIN_BUCKETS = 4;
 
-static void hm_start_resizing(HMap *hmap) {
+// create a table of n buckets and move the nodes to it
+static void hm_start_resizing(HMap *hmap, size_t n) {
     assert(hmap->ht2.tab == NULL);
-    // create a bigger hashtable and swap them
     hmap->ht2 = hmap->ht1;
-    h_init(&hmap->ht1, (hmap->ht1.mask + 1) * 2);
+    h_init(&hmap->ht1, n);
     hmap->resizing_pos = 0;
+    hmap->prefault_pos = 0;
 }
 
 void hm_insert(HMap *hmap, HNode *node) {
     if (!hmap->ht1.tab) {
-        h_init(&hmap->ht1, 4);
+        h_init(&hmap->ht1, K_MIN_BUCKETS);
     }
     h_insert(&hmap->ht1, node);
 
@@ -111,32 +161,154 @@ void hm_insert(HMap *hmap, HNode *node) {
         // check whether we need to resize
         size_t load_factor = hmap->ht1.size / (hmap->ht1.mask + 1);
         if (load_factor >= K_MAX_LOAD_FACTOR) {
-            hm_start_resizing(hmap);
+            hm_start_resizing(hmap, (hmap->ht1.mask + 1) * 2);
         }
     }
-    hm_help_resizing(hmap);
+    hm_help_resizing(hmap, K_RESIZING_WORK);
+}
+
+// shrink a sparse table after mass deletions,
+// to half the load factor that a doubling leaves behind
+static void hm_maybe_shrink(HMap *hmap) {
+    size_t n = hmap->ht1.mask + 1;
+    if (hmap->ht2.tab != NULL || n <= K_MIN_BUCKETS || hmap->ht1.size * 2 >= n) {
+        return;
+    }
+    size_t target = K_MIN_BUCKETS;
+    while (target * K_MAX_LOAD_FACTOR / 4 < hmap->ht1.size) {
+        target *= 2;
+    }
+    hm_start_resizing(hmap, target);
 }
 
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *)) {
-    hm_help_resizing(hmap);
+    hm_help_resizing(hmap, K_RESIZING_WORK);
     HNode **from = h_look_up(&hmap->ht1, key, cmp);
-    if (NULL != from) {
-        return h_detach(&hmap->ht1, from);
+    HTab *htab = &hmap->ht1;
+    if (NULL == from) {
+        from = h_look_up(&hmap->ht2, key, cmp);
+        htab = &hmap->ht2;
     }
-    from = h_look_up(&hmap->ht2, key, cmp);
-    if (NULL != from) {
-        return h_detach(&hmap->ht2, from);
+    if (NULL == from) {
+        return NULL;
     }
-    return NULL;
+    HNode *node = h_detach(htab, from);
+    hm_maybe_shrink(hmap);
+    return node;
+}
+
+bool hm_rehash(HMap *hmap, size_t max_work) {
+    hm_help_resizing(hmap, max_work);
+    return hm_resizing(hmap);
+}
+
+bool hm_resizing(HMap *hmap) {
+    return hmap->ht2.tab != NULL;
+}
+
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
+    if (tab->size == 0) {
+        return;
+    }
+    for (size_t i = 0; i <= tab->mask; i++) {
+        HNode *node = tab->tab[i];
+        while (node != NULL) {
+            f(node, arg);
+            node = node->next;
+        }
+    }
+}
+
+static size_t h_buckets_mask(HTab *tab) {
+    return tab->mask;
+}
+
+static void h_scan_bucket(HTab *tab, size_t pos,
+    void (*f)(HNode *, void *), void *arg) {
+    for (HNode *node = tab->tab[pos]; node != NULL; node = node->next) {
+        f(node, arg);
+    }
+}
+
+static uint64_t rev_bits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555) | ((v & 0x5555555555555555) << 1);
+    v = ((v >> 2) & 0x3333333333333333) | ((v & 0x3333333333333333) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0f) | ((v & 0x0f0f0f0f0f0f0f0f) << 4);
+    return __builtin_bswap64(v);
+}
+
+// increment the reversed cursor, the bits outside of the mask are skipped
+static uint64_t cursor_next(uint64_t cursor, size_t mask) {
+    cursor |= ~(uint64_t) mask;
+    return rev_bits(rev_bits(cursor) + 1);
+}
+
+uint64_t hm_scan(HMap *hmap, uint64_t cursor,
+    void (*f)(HNode *, void *), void *arg) {
+    HTab *t0 = &hmap->ht1;
+    HTab *t1 = &hmap->ht2;
+    if (!t0->tab) {
+        return 0;
+    }
+    if (!t1->tab) {
+        h_scan_bucket(t0, cursor & h_buckets_mask(t0), f, arg);
+        return cursor_next(cursor, h_buckets_mask(t0));
+    }
+
+    // during resizing, visit a bucket of the smaller table and all the
+    // buckets of the larger table that its nodes can be moved to
+    if (h_buckets_mask(t0) > h_buckets_mask(t1)) {
+        std::swap(t0, t1);
+    }
+    size_t m0 = h_buckets_mask(t0);
+    size_t m1 = h_buckets_mask(t1);
+    h_scan_bucket(t0, cursor & m0, f, arg);
+    do {
+        h_scan_bucket(t1, cursor & m1, f, arg);
+        cursor = cursor_next(cursor, m1);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
+
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg) {
+    h_scan(&hmap->ht1, f, arg);
+    h_scan(&hmap->ht2, f, arg);
+}
+
+// visit up to 10 buckets per wanted node, like the scan
+size_t hm_sample(HMap *hmap, uint64_t rand, HNode **out, size_t n) {
+    size_t cnt = 0;
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2}) {
+        if (htab->size == 0) {
+            continue;
+        }
+        size_t pos = rand & htab->mask;
+        for (size_t i = 0; i <= htab->mask && i < n * 10 && cnt < n; i++) {
+            HNode *node = htab->tab[(pos + i) & htab->mask];
+            for (; node != NULL && cnt < n; node = node->next) {
+                out[cnt++] = node;
+            }
+        }
+    }
+    return cnt;
 }
 
 size_t hm_size(HMap *hmap) {
     return hmap->ht1.size + hmap->ht2.size;
 }
 
+HMapStats hm_stats(HMap *hmap) {
+    HMapStats stats;
+    stats.slots = hmap->ht1.tab ? hmap->ht1.mask + 1 : 0;
+    stats.old_slots = hmap->ht2.tab ? hmap->ht2.mask + 1 : 0;
+    stats.moving = hmap->ht2.size;
+    stats.bytes = (hmap->ht1.tab ? h_bytes(&hmap->ht1) : 0) + (hmap->ht2.tab ? h_bytes(&hmap->ht2) : 0);
+    return stats;
+}
+
 void hm_destroy(HMap *hmap) {
     assert(hmap->ht1.size + hmap->ht2.size == 0);
-    free(hmap->ht1.tab);
-    free(hmap->ht2.tab);
+    h_free(&hmap->ht1);
+    h_free(&hmap->ht2);
     *hmap = HMap{};
 }
\ No newline at end of file
@@ -1,9 +1,31 @@
-#ifndef _HASHTABLE_H
-#define _HASHTABLE_H
+#ifndef _HMAP_H
+#define _HMAP_H
 
 #include <stddef.h>
 #include <stdint.h>
 
+#ifdef HMAP_SWISS
+
+// hashtable node, referenced from the slots of the table
+struct HNode {
+    uint64_t hcode = 0;
+};
+
+/**
+ * open addressing hashtable, see hashtable_swiss.cpp.
+ * the slots are probed in groups of 16, one control byte per slot
+ * holds 7 bits of the hash code, so a group is matched at once.
+*/
+struct HTab {
+    uint8_t *ctrl = NULL;
+    HNode **slots = NULL;
+    size_t mask = 0;    // number of slots - 1
+    size_t size = 0;    // number of nodes
+    size_t used = 0;    // number of nodes and deleted slots
+};
+
+#else
+
 // hashtable node
 struct HNode {
     HNode *next = NULL;
@@ -17,23 +39,77 @@ struct HTab {
     size_t size = 0;
 };
 
+#endif
+
 /**
  * final hashtable interface
 */
 struct HMap {
-    HTab ht1;
-    HTab ht2;
+    HTab ht1;       // the current table
+    HTab ht2;       // the table being resized from, its nodes are moved to ht1
     size_t resizing_pos = 0;
+    size_t prefault_pos = 0;    // the bytes of a new large ht1 faulted in
 };
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
 
 void hm_insert(HMap *hmap, HNode *node);
 
+/**
+ * prefetch what a lookup of `hcode` will touch, for the batched lookups:
+ * hash all the keys, call hm_prefetch() for each, then hm_prefetch_node()
+ * for each, then look them up, so the cache misses overlap instead of
+ * being paid one after the other.
+ * hm_prefetch() fetches the bucket, hm_prefetch_node() reads the bucket
+ * and fetches the first candidate node.
+*/
+void hm_prefetch(HMap *hmap, uint64_t hcode);
+
+void hm_prefetch_node(HMap *hmap, uint64_t hcode);
+
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
 
+// call f on every node
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg);
+
+/**
+ * visit the nodes of one bucket, for the iteration that can be resumed.
+ * the cursor walks the buckets in the order of the reversed bits of
+ * their index, so the nodes present during the whole iteration are visited
+ * at least once even if the table is resized in between.
+ * @return the next cursor, 0 when the iteration is done
+*/
+uint64_t hm_scan(HMap *hmap, uint64_t cursor,
+    void (*f)(HNode *, void *), void *arg);
+
+/**
+ * the table is resized incrementally, by a bounded amount of work on each
+ * operation: a doubling when it becomes full, a shrinking when it becomes
+ * sparse. call this in the idle time to move it forward.
+ * @return true if the resizing is not done yet
+*/
+bool hm_rehash(HMap *hmap, size_t max_work);
+
+bool hm_resizing(HMap *hmap);
+
+/**
+ * collect up to n nodes from around a random position, for the eviction.
+ * the cost is bounded by n, not by the size of the table.
+ * @return the number of nodes collected, 0 if the table is empty
+*/
+size_t hm_sample(HMap *hmap, uint64_t rand, HNode **out, size_t n);
+
 size_t hm_size(HMap *hmap);
 
+struct HMapStats {
+    size_t slots = 0;       // the capacity of the current table
+    size_t old_slots = 0;   // the capacity of the table being resized from, 0 if none
+    size_t moving = 0;      // the nodes left to move by the resizing
+    size_t bytes = 0;       // the arrays of both tables
+};
+
+HMapStats hm_stats(HMap *hmap);
+
 void hm_destroy(HMap *hmap);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,442 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "hashtable.h"
+#include "utils.h"
+
+// An open addressing hashtable in the style of the Swiss table.
+// The slots are grouped by 16. Each slot has a control byte which is either
+// empty, deleted, or the low 7 bits of the hash code of its node.
+// A lookup starts at the group picked by the rest of the hash code,
+// matches the 16 control bytes at once, and only follows the pointers of
+// the matching slots, so most lookups touch one control group and one node.
+
+const size_t K_GROUP = 16;
+
+const uint8_t CTRL_EMPTY = 0x00;
+const uint8_t CTRL_DELETED = 0x01;
+// a full slot has the high bit set and 7 bits of the hash code,
+// so a zeroed array is all empty slots
+
+static uint8_t h_ctrl(uint64_t hcode) {
+    return (uint8_t) (0x80 | (hcode & 0x7f));
+}
+
+static size_t h_group(HTab *htab, uint64_t hcode) {
+    return (size_t) (hcode >> 7) & (htab->mask / K_GROUP);
+}
+
+// bit i is set if the control byte i of the group equals `c`
+static uint32_t group_match(const uint8_t *ctrl, uint8_t c) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    __m128i cmp = _mm_cmpeq_epi8(group, _mm_set1_epi8((char) c));
+    return (uint32_t) _mm_movemask_epi8(cmp);
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < K_GROUP; i++) {
+        bits |= (uint32_t) (ctrl[i] == c) << i;
+    }
+    return bits;
+#endif
+}
+
+// bit i is set if the slot i of the group holds a node
+static uint32_t group_match_full(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *) ctrl);
+    return (uint32_t) _mm_movemask_epi8(group);
+#else
+    uint32_t bits = 0;
+    for (size_t i = 0; i < K_GROUP; i++) {
+        bits |= (uint32_t) (ctrl[i] >> 7) << i;
+    }
+    return bits;
+#endif
+}
+
+// bit i is set if the slot i of the group is empty or deleted
+static uint32_t group_match_free(const uint8_t *ctrl) {
+    return ~group_match_full(ctrl) & 0xffff;
+}
+
+// the control bytes and the slots are one array
+static size_t h_bytes(HTab *htab) {
+    return (htab->mask + 1) * (1 + sizeof(HNode *));
+}
+
+// n must be a power of 2, and at least a group
+static void h_init(HTab *htab, size_t n) {
+    assert(n >= K_GROUP && ((n - 1) & n) == 0);
+    htab->mask = n - 1;
+    htab->size = 0;
+    htab->used = 0;
+    htab->ctrl = (uint8_t *) table_alloc(h_bytes(htab));
+    htab->slots = (HNode **) (htab->ctrl + n);
+}
+
+// the probing visits every group once, the number of groups is a power of 2
+#define for_each_group(htab, hcode, g, i)                   \
+    for (size_t i = 0, g = h_group(htab, hcode);            \
+        i <= (htab)->mask / K_GROUP;                        \
+        i++, g = (g + i) & ((htab)->mask / K_GROUP))
+
+// hashtable insertion
+static void h_insert(HTab *htab, HNode *node) {
+    for_each_group(htab, node->hcode, g, i) {
+        uint8_t *ctrl = &htab->ctrl[g * K_GROUP];
+        uint32_t bits = group_match_free(ctrl);
+        if (bits) {
+            size_t pos = g * K_GROUP + __builtin_ctz(bits);
+            if (htab->ctrl[pos] == CTRL_EMPTY) {
+                htab->used++;
+            }
+            htab->ctrl[pos] = h_ctrl(node->hcode);
+            htab->slots[pos] = node;
+            htab->size++;
+            return;
+        }
+    }
+    assert(!"hashtable is full");
+}
+
+/**
+ * hashtable look up subroutine.
+ * @return the address of the slot that holds the target node
+*/
+static HNode **h_look_up(HTab *htab,
+    HNode *key, bool (*cmp)(HNode *, HNode *)) {
+    if (!htab->ctrl) {
+        return NULL;
+    }
+
+    uint8_t c = h_ctrl(key->hcode);
+    for_each_group(htab, key->hcode, g, i) {
+        uint8_t *ctrl = &htab->ctrl[g * K_GROUP];
+        for (uint32_t bits = group_match(ctrl, c); bits; bits &= bits - 1) {
+            HNode **from = &htab->slots[g * K_GROUP + __builtin_ctz(bits)];
+            if (cmp(*from, key)) {
+                return from;
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) {
+            // a probing for this key would have stopped here
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// remove a node from its slot
+static HNode *h_detach(HTab *htab, HNode **from) {
+    size_t pos = (size_t) (from - htab->slots);
+    size_t g = pos / K_GROUP;
+    // the slot can become empty if no probing goes past this group,
+    // otherwise it must stay as a tombstone
+    if (group_match(&htab->ctrl[g * K_GROUP], CTRL_EMPTY)) {
+        htab->ctrl[pos] = CTRL_EMPTY;
+        htab->used--;
+    } else {
+        htab->ctrl[pos] = CTRL_DELETED;
+    }
+    htab->size--;
+    return *from;
+}
+
+static void h_free(HTab *htab) {
+    if (htab->ctrl) {
+        table_free(htab->ctrl, h_bytes(htab));
+    }
+    *htab = HTab{};
+}
+
+const size_t K_RESIZING_WORK = 128;
+const size_t K_PREFAULT_BYTES = 256 << 10;
+
+// fault in the next part of a new large table, so that the inserts
+// don't all stall on the page faults right after the resizing starts
+static void hm_prefault(HMap *hmap) {
+    size_t total = h_bytes(&hmap->ht1);
+    if (total < K_TABLE_MMAP_BYTES || hmap->prefault_pos >= total) {
+        return;
+    }
+    size_t n = std::min(K_PREFAULT_BYTES, total - hmap->prefault_pos);
+    table_prefault(hmap->ht1.ctrl + hmap->prefault_pos, n);
+    hmap->prefault_pos += n;
+}
+
+// move up to `max_work` units from ht2 to ht1
+static void hm_help_resizing(HMap *hmap, size_t max_work) {
+    if (hmap->ht2.ctrl == NULL) {
+        return;
+    }
+    hm_prefault(hmap);
+
+    // move the nodes of ht2 to ht1, group by group.
+    // a moved node or a skipped group is a unit of work.
+    size_t nwork = 0;
+    while (nwork < max_work && hmap->ht2.size > 0) {
+        size_t g = hmap->resizing_pos;
+        uint8_t *ctrl = &hmap->ht2.ctrl[g * K_GROUP];
+        uint32_t bits = group_match_full(ctrl);
+        if (bits == 0) {
+            hmap->resizing_pos++;
+            nwork++;
+            continue;
+        }
+
+        size_t pos = g * K_GROUP + __builtin_ctz(bits);
+        HNode *node = hmap->ht2.slots[pos];
+        hmap->ht2.ctrl[pos] = CTRL_DELETED;
+        hmap->ht2.size--;
+        h_insert(&hmap->ht1, node);
+        nwork++;
+    }
+
+    if (hmap->ht2.size == 0) {
+        // done
+        h_free(&hmap->ht2);
+    }
+}
+
+HNode *hm_lookup(HMap *hmap, HNode *key,
+    bool (*cmp)(HNode *, HNode *)) {
+    hm_help_resizing(hmap, K_RESIZING_WORK);
+    HNode **from = h_look_up(&hmap->ht1, key, cmp);
+    if (from == NULL) {
+        from = h_look_up(&hmap->ht2, key, cmp);
+    }
+    if (from == NULL) {
+        return NULL;
+    }
+    return *from;
+}
+
+// the control bytes and the slots of the first group probed
+void hm_prefetch(HMap *hmap, uint64_t hcode) {
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2}) {
+        if (htab->ctrl) {
+            size_t pos = h_group(htab, hcode) * K_GROUP;
+            __builtin_prefetch(&htab->ctrl[pos]);
+            __builtin_prefetch(&htab->slots[pos]);
+            __builtin_prefetch(&htab->slots[pos + K_GROUP / 2]);
+        }
+    }
+}
+
+// the node of the first matching control byte
+void hm_prefetch_node(HMap *hmap, uint64_t hcode) {
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2}) {
+        if (htab->ctrl) {
+            size_t pos = h_group(htab, hcode) * K_GROUP;
+            uint32_t bits = group_match(&htab->ctrl[pos], h_ctrl(hcode));
+            if (bits) {
+                __builtin_prefetch(htab->slots[pos + __builtin_ctz(bits)]);
+            }
+        }
+    }
+}
+
+// the slots in use, including tombstones, must stay under 7/8.
+// the nodes left in ht2 are counted, they are all moved to ht1 eventually.
+static bool hm_is_full(HMap *hmap) {
+    size_t cap = hmap->ht1.mask + 1;
+    return hmap->ht1.used + hmap->ht2.size + 1 > cap - cap / 8;
+}
+
+// create a table of `cap` slots and move the nodes to it
+static void hm_start_resizing(HMap *hmap, size_t cap) {
+    assert(hmap->ht2.ctrl == NULL);
+    hmap->ht2 = hmap->ht1;
+    h_init(&hmap->ht1, cap);
+    hmap->resizing_pos = 0;
+    hmap->prefault_pos = 0;
+}
+
+void hm_insert(HMap *hmap, HNode *node) {
+    if (!hmap->ht1.ctrl) {
+        h_init(&hmap->ht1, K_GROUP);
+    }
+    if (hm_is_full(hmap)) {
+        // a resizing leaves enough room in ht1 for the inserts that finish it,
+        // see hm_maybe_shrink(), so there is no pending one to complete here
+        assert(hmap->ht2.ctrl == NULL);
+        // double the capacity, or rebuild at the same capacity
+        // if the table is mostly tombstones
+        size_t cap = hmap->ht1.mask + 1;
+        if (hmap->ht1.size * 2 >= cap - cap / 8) {
+            cap *= 2;
+        }
+        hm_start_resizing(hmap, cap);
+    }
+    h_insert(&hmap->ht1, node);
+    hm_help_resizing(hmap, K_RESIZING_WORK);
+}
+
+// the most a table shrinks at once. the new table must not fill up before
+// the old one is drained, which takes up to cap / 16 groups + size nodes of
+// work, K_RESIZING_WORK per insert. a table at most half full takes
+// 3/8 of its capacity in inserts to fill, more than that at this ratio.
+const size_t K_MAX_SHRINK = 256;
+
+// shrink a sparse table after mass deletions, to at most half full
+static void hm_maybe_shrink(HMap *hmap) {
+    size_t cap = hmap->ht1.mask + 1;
+    if (hmap->ht2.ctrl != NULL || cap <= K_GROUP || hmap->ht1.size * 8 >= cap) {
+        return;
+    }
+    size_t target = std::max(K_GROUP, cap / K_MAX_SHRINK);
+    while (target < hmap->ht1.size * 2) {
+        target *= 2;
+    }
+    hm_start_resizing(hmap, target);
+}
+
+HNode *hm_pop(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *)) {
+    hm_help_resizing(hmap, K_RESIZING_WORK);
+    HNode **from = h_look_up(&hmap->ht1, key, cmp);
+    HTab *htab = &hmap->ht1;
+    if (NULL == from) {
+        from = h_look_up(&hmap->ht2, key, cmp);
+        htab = &hmap->ht2;
+    }
+    if (NULL == from) {
+        return NULL;
+    }
+    HNode *node = h_detach(htab, from);
+    hm_maybe_shrink(hmap);
+    return node;
+}
+
+bool hm_rehash(HMap *hmap, size_t max_work) {
+    hm_help_resizing(hmap, max_work);
+    return hm_resizing(hmap);
+}
+
+bool hm_resizing(HMap *hmap) {
+    return hmap->ht2.ctrl != NULL;
+}
+
+static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
+    if (tab->size == 0) {
+        return;
+    }
+    for (size_t i = 0; i <= tab->mask; i++) {
+        if (tab->ctrl[i] & 0x80) {
+            f(tab->slots[i], arg);
+        }
+    }
+}
+
+// a bucket of the scan is a group, holding the nodes that start probing there
+static size_t h_buckets_mask(HTab *tab) {
+    return tab->mask / K_GROUP;
+}
+
+// the nodes of a home group are on its probe sequence,
+// before the first group with an empty slot, the same as for a lookup
+static void h_scan_bucket(HTab *tab, size_t home,
+    void (*f)(HNode *, void *), void *arg) {
+    size_t gmask = tab->mask / K_GROUP;
+    for (size_t i = 0, g = home; i <= gmask; i++, g = (g + i) & gmask) {
+        uint8_t *ctrl = &tab->ctrl[g * K_GROUP];
+        uint32_t bits = group_match_full(ctrl);
+        for (; bits; bits &= bits - 1) {
+            HNode *node = tab->slots[g * K_GROUP + __builtin_ctz(bits)];
+            if (h_group(tab, node->hcode) == home) {
+                f(node, arg);
+            }
+        }
+        if (group_match(ctrl, CTRL_EMPTY)) {
+            break;
+        }
+    }
+}
+
+static uint64_t rev_bits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555) | ((v & 0x5555555555555555) << 1);
+    v = ((v >> 2) & 0x3333333333333333) | ((v & 0x3333333333333333) << 2);
+    v = ((v >> 4) & 0x0f0f0f0f0f0f0f0f) | ((v & 0x0f0f0f0f0f0f0f0f) << 4);
+    return __builtin_bswap64(v);
+}
+
+// increment the reversed cursor, the bits outside of the mask are skipped
+static uint64_t cursor_next(uint64_t cursor, size_t mask) {
+    cursor |= ~(uint64_t) mask;
+    return rev_bits(rev_bits(cursor) + 1);
+}
+
+uint64_t hm_scan(HMap *hmap, uint64_t cursor,
+    void (*f)(HNode *, void *), void *arg) {
+    HTab *t0 = &hmap->ht1;
+    HTab *t1 = &hmap->ht2;
+    if (!t0->ctrl) {
+        return 0;
+    }
+    if (!t1->ctrl) {
+        h_scan_bucket(t0, cursor & h_buckets_mask(t0), f, arg);
+        return cursor_next(cursor, h_buckets_mask(t0));
+    }
+
+    // during resizing, visit a bucket of the smaller table and all the
+    // buckets of the larger table that its nodes can be moved to
+    if (h_buckets_mask(t0) > h_buckets_mask(t1)) {
+        std::swap(t0, t1);
+    }
+    size_t m0 = h_buckets_mask(t0);
+    size_t m1 = h_buckets_mask(t1);
+    h_scan_bucket(t0, cursor & m0, f, arg);
+    do {
+        h_scan_bucket(t1, cursor & m1, f, arg);
+        cursor = cursor_next(cursor, m1);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
+
+void hm_foreach(HMap *hmap, void (*f)(HNode *, void *), void *arg) {
+    h_scan(&hmap->ht1, f, arg);
+    h_scan(&hmap->ht2, f, arg);
+}
+
+// visit up to a group of slots per wanted node
+size_t hm_sample(HMap *hmap, uint64_t rand, HNode **out, size_t n) {
+    size_t cnt = 0;
+    for (HTab *htab : {&hmap->ht1, &hmap->ht2}) {
+        if (htab->size == 0) {
+            continue;
+        }
+        size_t pos = rand & htab->mask;
+        for (size_t i = 0; i <= htab->mask && i < n * K_GROUP && cnt < n; i++) {
+            size_t slot = (pos + i) & htab->mask;
+            if (htab->ctrl[slot] & 0x80) {
+                out[cnt++] = htab->slots[slot];
+            }
+        }
+    }
+    return cnt;
+}
+
+size_t hm_size(HMap *hmap) {
+    return hmap->ht1.size + hmap->ht2.size;
+}
+
+HMapStats hm_stats(HMap *hmap) {
+    HMapStats stats;
+    stats.slots = hmap->ht1.ctrl ? hmap->ht1.mask + 1 : 0;
+    stats.old_slots = hmap->ht2.ctrl ? hmap->ht2.mask + 1 : 0;
+    stats.moving = hmap->ht2.size;
+    stats.bytes = (hmap->ht1.ctrl ? h_bytes(&hmap->ht1) : 0) + (hmap->ht2.ctrl ? h_bytes(&hmap->ht2) : 0);
+    return stats;
+}
+
+void hm_destroy(HMap *hmap) {
+    assert(hmap->ht1.size + hmap->ht2.size == 0);
+    h_free(&hmap->ht1);
+    h_free(&hmap->ht2);
+    *hmap = HMap{};
+}
@@ -0,0 +1,58 @@
+#include "heap.h"
+
+// 4 children per node halves the depth of a binary heap,
+// and the children share a cache line when sifting down
+const size_t K_HEAP_ARITY = 4;
+
+static size_t heap_parent(size_t i) {
+    return (i - 1) / K_HEAP_ARITY;
+}
+
+static size_t heap_child(size_t i) {
+    return i * K_HEAP_ARITY + 1;
+}
+
+static void heap_up(HeapItem *a, size_t pos) {
+    HeapItem t = a[pos];
+    while (pos > 0 && a[heap_parent(pos)].val > t.val) {
+        // swap with the parent
+        a[pos] = a[heap_parent(pos)];
+        *a[pos].ref = (uint32_t) pos;
+        pos = heap_parent(pos);
+    }
+    a[pos] = t;
+    *a[pos].ref = (uint32_t) pos;
+}
+
+static void heap_down(HeapItem *a, size_t pos, size_t len) {
+    HeapItem t = a[pos];
+    while (true) {
+        // find the smallest one among the parent and its kids
+        size_t min_pos = pos;
+        uint64_t min_val = t.val;
+        size_t first = heap_child(pos);
+        for (size_t i = first; i < first + K_HEAP_ARITY && i < len; i++) {
+            if (a[i].val < min_val) {
+                min_pos = i;
+                min_val = a[i].val;
+            }
+        }
+        if (min_pos == pos) {
+            break;
+        }
+        // swap with the kid
+        a[pos] = a[min_pos];
+        *a[pos].ref = (uint32_t) pos;
+        pos = min_pos;
+    }
+    a[pos] = t;
+    *a[pos].ref = (uint32_t) pos;
+}
+
+void heap_update(HeapItem *a, size_t pos, size_t len) {
+    if (pos > 0 && a[heap_parent(pos)].val > a[pos].val) {
+        heap_up(a, pos);
+    } else {
+        heap_down(a, pos, len);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef _HEAP_H
+#define _HEAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * an item of the 4-ary min heap.
+ * `ref` points to the position stored in the owner, and is kept
+ * up to date when the item moves, so the owner can update or remove it.
+*/
+struct HeapItem {
+    uint64_t val = 0;
+    uint32_t *ref = NULL;
+};
+
+// restore the heap order after the item at `pos` is changed
+void heap_update(HeapItem *a, size_t pos, size_t len);
+
+#endif
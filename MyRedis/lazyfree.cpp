@@ -0,0 +1,89 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <atomic>
+#include <thread>
+#include "lazyfree.h"
+#include "queue.h"
+#include "utils.h"
+
+enum {
+    LAZY_MEM = 0,
+    LAZY_ZSET = 1,
+    LAZY_HASH = 2,
+};
+
+struct LazyJob {
+    QNode qnode;
+    uint32_t type = LAZY_MEM;
+    void *ptr = NULL;
+};
+
+static struct {
+    MPSCQueue queue;
+    int wake_fd = -1;   // eventfd, the thread blocks on it while the queue is empty
+    std::atomic<uint64_t> pending{0};
+} g_lazy;
+
+static void lazy_run() {
+    while (true) {
+        uint64_t cnt = 0;
+        if (read(g_lazy.wake_fd, &cnt, sizeof(cnt)) < 0) {
+            continue;
+        }
+        QNode *node = mpsc_take_all(&g_lazy.queue);
+        while (node) {
+            LazyJob *job = container_of(node, LazyJob, qnode);
+            node = node->next;
+            if (job->type == LAZY_ZSET) {
+                ZSet *zset = (ZSet *) job->ptr;
+                zset_dispose(zset);
+                delete zset;
+            } else if (job->type == LAZY_HASH) {
+                Hash *hash = (Hash *) job->ptr;
+                hash_dispose(hash);
+                delete hash;
+            } else {
+                free(job->ptr);
+            }
+            delete job;
+            g_lazy.pending.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+void lazyfree_start() {
+    // blocking, unlike the eventfd of the event loops
+    g_lazy.wake_fd = eventfd(0, 0);
+    if (g_lazy.wake_fd < 0) {
+        die("eventfd()");
+    }
+    std::thread(lazy_run).detach();
+}
+
+static void lazy_push(uint32_t type, void *ptr) {
+    LazyJob *job = new LazyJob();
+    job->type = type;
+    job->ptr = ptr;
+    g_lazy.pending.fetch_add(1, std::memory_order_relaxed);
+    if (mpsc_push(&g_lazy.queue, &job->qnode)) {
+        uint64_t one = 1;
+        (void) write(g_lazy.wake_fd, &one, sizeof(one));
+    }
+}
+
+void lazyfree_mem(void *ptr) {
+    lazy_push(LAZY_MEM, ptr);
+}
+
+void lazyfree_zset(ZSet *zset) {
+    lazy_push(LAZY_ZSET, zset);
+}
+
+void lazyfree_hash(Hash *hash) {
+    lazy_push(LAZY_HASH, hash);
+}
+
+uint64_t lazyfree_pending() {
+    return g_lazy.pending.load(std::memory_order_relaxed);
+}
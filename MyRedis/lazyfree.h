@@ -0,0 +1,27 @@
+#ifndef _LAZYFREE_H
+#define _LAZYFREE_H
+
+#include <stdint.h>
+#include "zset.h"
+#include "hash.h"
+
+/**
+ * the lazyfree thread frees the large values detached from the keyspace,
+ * so the event loops don't stall on them.
+ * the objects are passed through a lock-free queue.
+*/
+void lazyfree_start();
+
+// free a malloc'd block
+void lazyfree_mem(void *ptr);
+
+// dispose and delete a sorted set
+void lazyfree_zset(ZSet *zset);
+
+// dispose and delete a hash
+void lazyfree_hash(Hash *hash);
+
+// the number of objects queued and not freed yet
+uint64_t lazyfree_pending();
+
+#endif
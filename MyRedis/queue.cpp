@@ -0,0 +1,24 @@
+#include "queue.h"
+
+bool mpsc_push(MPSCQueue *q, QNode *node) {
+    QNode *head = q->head.load(std::memory_order_relaxed);
+    do {
+        node->next = head;
+    } while (!q->head.compare_exchange_weak(
+        head, node, std::memory_order_release, std::memory_order_relaxed));
+    return head == NULL;
+}
+
+QNode *mpsc_take_all(MPSCQueue *q) {
+    QNode *node = q->head.exchange(NULL, std::memory_order_acquire);
+
+    // the pushed nodes form a LIFO stack, reverse it
+    QNode *list = NULL;
+    while (node != NULL) {
+        QNode *next = node->next;
+        node->next = list;
+        list = node;
+        node = next;
+    }
+    return list;
+}
@@ -0,0 +1,31 @@
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+// intrusive queue node, embedded into the queued object
+struct QNode {
+    QNode *next = NULL;
+};
+
+/**
+ * lock-free multi-producer single-consumer queue.
+ * producers push with a CAS, the consumer takes the whole queue at once.
+*/
+struct MPSCQueue {
+    std::atomic<QNode *> head{NULL};
+};
+
+/**
+ * @return true if the queue was empty, the consumer needs a wakeup
+*/
+bool mpsc_push(MPSCQueue *q, QNode *node);
+
+/**
+ * detach all the queued nodes
+ * @return the nodes as a list in FIFO order
+*/
+QNode *mpsc_take_all(MPSCQueue *q);
+
+#endif
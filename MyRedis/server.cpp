@@ -3,38 +3,119 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <malloc.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <netinet/ip.h>
 #include <assert.h>
+#include <algorithm>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
+#include <thread>
+#include <new>
+#include <charconv>
 #include "constants.h"
 #include "utils.h"
 #include "hashtable.h"
+#include "queue.h"
+#include "buffer.h"
+#include "slab.h"
+#include "zset.h"
+#include "hash.h"
+#include "heap.h"
+#include "list.h"
+#include "lazyfree.h"
+#include "aof.h"
+#include "stats.h"
+
+const size_t K_MAX_EVENTS = 1024;
+// the minimal free space for a read()
+const size_t K_READ_MIN = 1024;
+// empty buffers larger than this are released
+const size_t K_BUF_KEEP = 4096;
+// stop executing pipelined requests and flush once this much output is queued
+const size_t K_WBUF_HIGH = 1 << 20;
+
+// what happens to the writes over maxmemory
+enum {
+    EVICT_NONE = 0,     // reject them
+    EVICT_LRU = 1,      // evict the least recently used of a few sampled keys
+    EVICT_LFU = 2,      // evict the least frequently used of a few sampled keys
+};
+
+// the most keys sampled for an eviction
+const uint32_t K_MAX_EVICT_SAMPLES = 64;
 
-#define container_of(ptr, type, member) ({                  \
-    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
-    (type *)( (char *)__mptr - offsetof(type, member) );})
+// runtime options, see parse_args()
+static struct {
+    bool epoll_et = false;  // edge-triggered epoll instead of level-triggered
+    uint32_t nthreads = 1;  // number of event loops, each one owns a shard
+    uint64_t idle_timeout_ms = 0;           // close idle connections, 0 disables
+    const char *snapshot = "dump.rdb";      // written by bgsave, loaded at startup
+    const char *aof = NULL;                 // the append-only file, off by default
+    uint32_t aof_fsync = AOF_FSYNC_EVERYSEC;
+    uint64_t maxmemory = 0;                 // the limit of the keyspace in bytes, 0 for none
+    uint32_t maxmemory_policy = EVICT_NONE;
+    uint32_t maxmemory_samples = 5;         // the keys compared per eviction
+} g_config;
 
 struct Conn {
     int fd = -1;
     uint32_t state = 0; // either STATE_REQ or STATE_RES
     
     // buffer for reading
-    size_t rbuf_size = 0;
-    uint8_t rbuf[4 + K_MAX_MSG];
+    Buffer rbuf;
 
     // buffer for writing
-    size_t wbuf_size = 0;
-    size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + K_MAX_MSG];
+    Buffer wbuf;
+
+    // the arguments of the current request, pointing into rbuf.
+    // reused by every request of the connection.
+    std::vector<std::string_view> cmd;
+
+    // the time of the last I/O, for the idle timeout
+    uint64_t idle_start = 0;
+    // on the idle list of the loop, the least recently active first
+    DList idle_node;
+    // the client hung up in STATE_WAIT, close once the forward is replied
+    bool hangup = false;
+};
+
+// ====== event loops ======
+// Each event loop thread owns its connections and a shard of the keyspace.
+// Commands on keys of other shards are forwarded through the inbox of the owner.
+struct Data;
+
+struct Loop {
+    int32_t id = 0;
+    Data *data = NULL;    // the shard, for the snapshot
+    int epfd = -1;
+    int listen_fd = -1;   // SO_REUSEPORT socket, the kernel spreads connections
+    int wake_fd = -1;     // eventfd, signaled when the inbox becomes non-empty
+    MPSCQueue inbox;
+    // a map of all client connections, keyed by fd
+    std::vector<Conn *> fd2conn;
+    // the connections ordered by their last I/O, the oldest first
+    DList idle_list;
+    // the writes executed in this iteration, appended to the AOF at once
+    Buffer aof_buf;
+    bool replaying = false;   // executing the AOF at startup, not logged again
 };
 
+static std::vector<Loop *> g_loops;
+static thread_local Loop *g_loop = NULL;
+
 static void fd_set_nb(int fd) {
     // syscall for setting an fd to nonblocking mode is fcntl
     errno = 0;
@@ -101,7 +182,12 @@ static int32_t write_all(int fd, const char *buf, size_t n) {
 static void state_req(Conn *conn);
 static void state_res(Conn *conn);
 
-static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string> &out) {
+/**
+ * split the request into arguments without copying them,
+ * the views are valid until the request is removed from the buffer.
+*/
+static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::string_view> &out) {
+    out.clear();
     if (len < 4) return -1;
 
     uint32_t argc = 0;
@@ -120,7 +206,7 @@ static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::strin
         if (pos + 4 + arg_len > len) {
             return -1;
         }
-        out.push_back(std::string((char*) &data[pos + 4], arg_len));
+        out.push_back(std::string_view((const char *) &data[pos + 4], arg_len));
         pos += arg_len + 4;
     }
 
@@ -131,450 +217,3065 @@ static int32_t parse_req(const uint8_t *data, size_t len, std::vector<std::strin
     return 0;
 }
 
-// the structure for the key
-struct Entry {
-    struct HNode node;
-    std::string key;
-    std::string value;
-};
-
-// The data structure for the key space
-static struct {
+// The data structure for the key space.
+// Each event loop thread owns its shard of the keys, nothing is shared.
+struct Data {
     HMap db;
-} g_data;
-
+    // the deadlines of the keys with a TTL
+    std::vector<HeapItem> heap;
+    // the bytes of the entries and their values, see entry_mem()
+    size_t entry_bytes = 0;
+};
 
-static std::map<std::string, std::string> g_map;
+static thread_local Data g_data;
 
-static bool entry_eq(HNode *lhs, HNode *rhs) {
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return lhs->hcode == rhs->hcode && le->key == re->key;
+static uint64_t get_monotonic_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
-// ====== The code for our serialization protocol ======
-// TLV(type-length-value)
-static void out_nil(std::string &out) {
-    out.push_back(SER_NIL);
+// the unix time, for the deadlines that outlive the process
+static uint64_t get_realtime_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
 }
 
+enum {
+    ENTRY_VAL_INLINE = 1,   // the value is stored after the key
+    ENTRY_VAL_INT = 2,      // the value is an int64 stored after the key
+};
+
+// the heap position of an entry without a TTL
+const uint32_t K_HEAP_NONE = UINT32_MAX;
+
+// value types
+enum {
+    T_STR = 0,
+    T_ZSET = 1,     // the pointer to a ZSet follows the key
+    T_HASH = 2,     // the pointer to a Hash follows the key
+};
+
 /**
- * note: string& append (const char* s, size_t n);
- * n: Number of characters to copy.
+ * the structure for the key.
+ * one slab allocation holds the header, the key, and the value if it fits.
+ * a larger value is allocated out of line and its pointer follows the key.
+ * a sorted set or a hash is always out of line, it takes the room of the pointer.
+ * a string that is an integer is stored as an int64, in the room of the
+ * value or of the pointer, see entry_set_int().
+ * +-------------+--------------+------------------------------+
+ * | header      | key (klen)   | value (vlen <= vcap) or ptr  |
+ * +-------------+--------------+------------------------------+
 */
-static void out_str(std::string &out, const std::string &val) {
-    // +---------+-------------+-----+------+--------
-    // | SER_STR | len(4Bytes) |   val(len Bytes)
-    // +---------+-------------+-----+------+--------
-    out.push_back(SER_STR);
-    uint32_t len = (uint32_t) val.size();
-    out.append((char *)&len, 4);
-    out.append(val);
-}
+struct Entry {
+    struct HNode node;
+    uint32_t klen = 0;
+    uint32_t vlen = 0;
+    uint32_t vcap = 0;              // the capacity for the value
+    uint32_t heap_idx = K_HEAP_NONE;  // the position in g_data.heap
+    uint32_t access = 0;            // the LRU clock or the LFU counter, see entry_touch()
+    uint8_t sclass = K_SLAB_NONE;   // slab class, K_SLAB_NONE if from malloc
+    uint8_t flags = 0;
+    uint8_t type = T_STR;
+    char data[];
+};
 
-static void out_int(std::string &out, int64_t val) {
-    out.push_back(SER_INT);
-    out.append((char *)&val, 8);
+static std::string_view entry_key(Entry *ent) {
+    return std::string_view(ent->data, ent->klen);
 }
 
-static void out_err(std::string &out, int32_t code, const std::string &msg) {
-    out.push_back(SER_ERR);
-    out.append((char *)&code, 4); // 4 Bytes error code
-    uint32_t len = (uint32_t) msg.size();
-    out.append((char *) &len, 4);
-    out.append(msg);
+static char *entry_val_ptr(Entry *ent) {
+    if (ent->flags & ENTRY_VAL_INLINE) {
+        return ent->data + ent->klen;
+    }
+    char *ptr = NULL;
+    memcpy(&ptr, ent->data + ent->klen, sizeof(ptr));
+    return ptr;
 }
 
-static void out_arr(std::string &out, uint32_t n) {
-    out.push_back(SER_ARR);
-    out.append((char *)&n, 4);
-}
+// the longest int64 in decimal
+const size_t K_INT_CHARS = 20;
 
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg);
-static void cb_scan(HNode *node, void *arg);
+static std::string_view int_str(int64_t val, char *buf) {
+    char *end = std::to_chars(buf, buf + K_INT_CHARS, val).ptr;
+    return std::string_view(buf, (size_t) (end - buf));
+}
 
-static void do_get(
-    std::vector<std::string> &cmd, 
-    std::string &out) {
-    
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (NULL == node) {
-        return out_nil(out);
+// an integer in the form it's formatted back to, so it's stored as an int64
+static bool str_is_int(std::string_view s, int64_t &val) {
+    if (s.empty() || s.size() > K_INT_CHARS) {
+        return false;
     }
-
-    const std::string &val = container_of(node, Entry, node)->value;
-   
-    assert(val.size() <= K_MAX_MSG);
-    return out_str(out, val);
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), val);
+    char buf[K_INT_CHARS];
+    return ec == std::errc() && end == s.data() + s.size() && int_str(val, buf) == s;
 }
 
-static void do_set(
-    std::vector<std::string> &cmd, 
-    std::string &out) {
-
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static int64_t entry_int(Entry *ent) {
+    assert(ent->flags & ENTRY_VAL_INT);
+    int64_t val = 0;
+    memcpy(&val, ent->data + ent->klen, sizeof(val));
+    return val;
+}
 
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (NULL != node) {
-        std::string &val = container_of(node, Entry, node)->value;
-        val.swap(cmd[2]);
-    } else {
-        Entry *entry = new Entry();
-        entry->key.swap(key.key);
-        entry->node.hcode = key.node.hcode;
-        entry->value.swap(cmd[2]);
-        hm_insert(&g_data.db, &(entry->node));
+// the value as a string, an integer is formatted in `buf` of K_INT_CHARS
+static std::string_view entry_val(Entry *ent, char *buf) {
+    if (ent->flags & ENTRY_VAL_INT) {
+        return int_str(entry_int(ent), buf);
     }
-    return out_nil(out);
+    return std::string_view(entry_val_ptr(ent), ent->vlen);
 }
 
-static void do_del(
-    std::vector<std::string> &cmd, 
-    std::string &out) {
+static ZSet *entry_zset(Entry *ent) {
+    assert(ent->type == T_ZSET);
+    ZSet *zset = NULL;
+    memcpy(&zset, ent->data + ent->klen, sizeof(zset));
+    return zset;
+}
 
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+static Hash *entry_hash(Entry *ent) {
+    assert(ent->type == T_HASH);
+    Hash *hash = NULL;
+    memcpy(&hash, ent->data + ent->klen, sizeof(hash));
+    return hash;
+}
 
-    HNode *node = hm_pop(&g_data.db, &key.node, &entry_eq);
-    if (NULL != node) {
-        delete container_of(node, Entry, node);
+// the bytes of an entry and its value, accounted in g_data.entry_bytes
+static size_t entry_mem(Entry *ent) {
+    size_t size = ent->sclass != K_SLAB_NONE ? slab_class_size(ent->sclass)
+        : offsetof(Entry, data) + ent->klen + sizeof(char *);
+    if (ent->type == T_ZSET) {
+        size += zset_mem(entry_zset(ent));
+    } else if (ent->type == T_HASH) {
+        size += hash_mem(entry_hash(ent));
+    } else if (!(ent->flags & ENTRY_VAL_INLINE)) {
+        size += ent->vcap;
     }
-    return out_int(out, node ? 1 : 0);
+    return size;
 }
 
-static void do_keys(std::vector<std::string> &cmd, std::string &out) {
-    (void) cmd;
-    out_arr(out ,(uint32_t)hm_size(&g_data.db));
-    h_scan(&g_data.db.ht1, &cb_scan, &out);
-    h_scan(&g_data.db.ht2, &cb_scan, &out);
-}
+static_assert(sizeof(int64_t) <= sizeof(char *), "an int64 takes the room of the pointer");
 
-static bool cmd_is(const std::string &word, const char * cmd) {
-    return 0 == strcasecmp(word.c_str(), cmd);
+// an out of line value is freed, its pointer is replaced by the integer
+static void entry_set_int(Entry *ent, int64_t val) {
+    size_t before = entry_mem(ent);
+    if (!(ent->flags & (ENTRY_VAL_INLINE | ENTRY_VAL_INT))) {
+        free(entry_val_ptr(ent));
+        ent->vcap = 0;
+    }
+    ent->flags |= ENTRY_VAL_INT;
+    ent->vlen = 0;
+    memcpy(ent->data + ent->klen, &val, sizeof(val));
+    g_data.entry_bytes += entry_mem(ent) - before;
 }
 
-static void h_scan(HTab *tab, void (*f)(HNode *, void *), void *arg) {
-    if (tab->size == 0) {
-        return;
+static void entry_set_val(Entry *ent, std::string_view val) {
+    int64_t ival = 0;
+    if (str_is_int(val, ival)) {
+        return entry_set_int(ent, ival);
+    }
+    size_t before = entry_mem(ent);
+    if (ent->flags & ENTRY_VAL_INT) {
+        // back to a string, in the room of the value or of the pointer
+        ent->flags &= ~ENTRY_VAL_INT;
+        char *ptr = NULL;
+        memcpy(ent->data + ent->klen, &ptr, sizeof(ptr));
     }
-    for (size_t i = 0; i <= tab->mask; i++) {
-        HNode *node = tab->tab[i];
-        while (node != NULL) {
-            f(node, arg);
-            node = node->next;
+    if ((ent->flags & ENTRY_VAL_INLINE) && val.size() > ent->vcap) {
+        // outgrown the allocation, move the value out of line
+        ent->flags &= ~ENTRY_VAL_INLINE;
+        ent->vcap = 0;
+        char *ptr = NULL;
+        memcpy(ent->data + ent->klen, &ptr, sizeof(ptr));
+    }
+    if (!(ent->flags & ENTRY_VAL_INLINE) && val.size() > ent->vcap) {
+        char *ptr = (char *) realloc(entry_val_ptr(ent), val.size());
+        if (!ptr) {
+            die("out of memory");
         }
+        memcpy(ent->data + ent->klen, &ptr, sizeof(ptr));
+        ent->vcap = (uint32_t) val.size();
+    }
+    if (!val.empty()) {
+        memcpy(entry_val_ptr(ent), val.data(), val.size());
     }
+    ent->vlen = (uint32_t) val.size();
+    g_data.entry_bytes += entry_mem(ent) - before;
 }
 
-static void cb_scan(HNode *node, void *arg) {
-    std::string &out = *(std::string *)arg;
-    out_str(out, container_of(node, Entry, node)->key);
+// ====== eviction ======
+// the keys over maxmemory are evicted by sampling a few of them and
+// picking the least recently or the least frequently used one.
+// the state is kept in the 32 bits of Entry::access.
+
+// a tiny PRNG for the sampling, no need for a good one
+static uint64_t rand_u64() {
+    static thread_local uint64_t state = 0x9E3779B97F4A7C15ull;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
 }
 
-/**
- * recognize get, set, del
- * @return return -1 if bad req
-*/
-static int32_t do_request(std::vector<std::string> &cmd, std::string &out) {
-    // TODO: need to modify
-    if (cmd.size() == 2 && cmd_is(cmd[0], "get")) {
-        do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd_is(cmd[0], "set")) {
-        do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd_is(cmd[0], "del")) {
-        do_del(cmd, out);
-    } else if (cmd.size() == 1 && cmd_is(cmd[0], "keys")) {
-        do_keys(cmd, out);
-    } else {
-        // the cmd is not recognized
-        out_err(out, ERR_UNKNOWN, "Unknown cmd");
-    }
-    return 0;
+// LFU: the time of the last decay in minutes (24 bits) and a counter (8 bits).
+// the counter grows logarithmically with the hits, and decays by 1 per minute.
+const uint32_t K_LFU_INIT = 5;          // a new key isn't evicted right away
+const uint32_t K_LFU_LOG_FACTOR = 10;
+
+static uint32_t lfu_counter(Entry *ent, uint64_t now_min) {
+    uint32_t counter = ent->access & 0xff;
+    uint32_t elapsed = ((uint32_t) now_min - (ent->access >> 8)) & 0xffffff;
+    return counter > elapsed ? counter - elapsed : 0;
 }
 
+static uint32_t lfu_access(uint64_t now_min, uint32_t counter) {
+    return ((uint32_t) now_min << 8) | counter;
+}
 
-static int32_t try_one_request(Conn *conn) {
-    // 4 bytes header, like this:
-    // +-----+------+-----+------+--------
-    // | len | msg1 | len | msg2 | more...
-    // +-----+------+-----+------+--------
-    
-    if (conn->rbuf_size < 4) {
-        // not enough data in the buffer. Will retry in the next iteration
-        return false;
+// a new key
+static void entry_init_access(Entry *ent) {
+    if (g_config.maxmemory_policy == EVICT_LRU) {
+        // milliseconds, the wraparound after 49 days is harmless
+        ent->access = (uint32_t) get_monotonic_msec();
+    } else if (g_config.maxmemory_policy == EVICT_LFU) {
+        ent->access = lfu_access(get_monotonic_msec() / 60000, K_LFU_INIT);
     }
+}
 
-    uint32_t len = 0;
-    memcpy(&len, conn->rbuf, 4);  // assume little endian
-    if (len > K_MAX_MSG) {
-        msg("too long");
-        conn->state = STATE_END;
-        return false;
-    }
-    if (4 + len > conn->rbuf_size) {
-        // not enough data in the buffer. Will retry in the next iteration
-        return false;
+// a hit on the key
+static void entry_touch(Entry *ent) {
+    if (g_config.maxmemory_policy == EVICT_LRU) {
+        ent->access = (uint32_t) get_monotonic_msec();
+    } else if (g_config.maxmemory_policy == EVICT_LFU) {
+        uint64_t now_min = get_monotonic_msec() / 60000;
+        uint32_t counter = lfu_counter(ent, now_min);
+        // the higher the counter, the less likely an increment
+        uint32_t base = counter > K_LFU_INIT ? counter - K_LFU_INIT : 0;
+        if (counter < 255 && rand_u64() % (base * K_LFU_LOG_FACTOR + 1) == 0) {
+            counter++;
+        }
+        ent->access = lfu_access(now_min, counter);
     }
+}
 
-    // parse the request
-    std::vector<std::string> cmd;
-    if (0 != parse_req(&conn->rbuf[4], len, cmd)) {
-        msg("bad req");
-        conn->state = STATE_END;
-        return false;
+// the larger, the better to evict
+static uint64_t entry_evict_score(Entry *ent, uint64_t now_ms) {
+    if (g_config.maxmemory_policy == EVICT_LFU) {
+        return 255 - lfu_counter(ent, now_ms / 60000);
     }
+    return (uint32_t) now_ms - ent->access;     // the idle time
+}
 
-    // got one request
-    std::string out;
-    do_request(cmd, out);
+static Entry *entry_new(std::string_view key, uint64_t hcode, std::string_view val) {
+    // the room after the key holds at least the out of line pointer
+    size_t base = offsetof(Entry, data) + key.size();
+    int64_t ival = 0;
+    size_t vlen = str_is_int(val, ival) ? 0 : val.size();
+    size_t vsize = vlen < sizeof(char *) ? sizeof(char *) : vlen;
+    bool inl = slab_class(base + vsize) != K_SLAB_NONE;
+    size_t size = base + (inl ? vsize : sizeof(char *));
+
+    uint32_t sclass = slab_class(size);
+    void *mem = NULL;
+    if (sclass != K_SLAB_NONE) {
+        mem = slab_alloc(sclass);
+        size = slab_class_size(sclass);
+    } else {
+        mem = malloc(size);
+        if (!mem) {
+            die("out of memory");
+        }
+    }
 
-    // pack the response into the buffer
-    if (4 + out.size() > K_MAX_MSG) {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+    Entry *ent = new (mem) Entry();
+    ent->node.hcode = hcode;
+    ent->sclass = (uint8_t) sclass;
+    ent->klen = (uint32_t) key.size();
+    memcpy(ent->data, key.data(), key.size());
+    if (inl) {
+        ent->flags |= ENTRY_VAL_INLINE;
+        ent->vcap = (uint32_t) (size - base);
+    } else {
+        char *ptr = NULL;
+        memcpy(ent->data + ent->klen, &ptr, sizeof(ptr));
     }
+    entry_init_access(ent);
+    g_data.entry_bytes += entry_mem(ent);
+    entry_set_val(ent, val);
+    return ent;
+}
 
-    // generate the response
-    uint32_t rescode = 0;
-    uint32_t wlen = (uint32_t)out.size();
+static Entry *entry_new_zset(std::string_view key, uint64_t hcode) {
+    // an empty value leaves the room for a pointer after the key
+    Entry *ent = entry_new(key, hcode, std::string_view());
+    ZSet *zset = new ZSet();
+    ent->type = T_ZSET;
+    memcpy(ent->data + ent->klen, &zset, sizeof(zset));
+    g_data.entry_bytes += zset_mem(zset);
+    return ent;
+}
 
-    memcpy(conn->wbuf, &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = wlen + 4;
+// zset_add() on an entry, with the memory accounting
+static bool entry_zadd(Entry *ent, std::string_view name, double score) {
+    size_t before = entry_mem(ent);
+    bool added = zset_add(entry_zset(ent), name, score);
+    g_data.entry_bytes += entry_mem(ent) - before;
+    return added;
+}
 
-    // remove the request from the buffer
-    // note: frequent memmove is inefficient.
-    // note: need better handling for production code
-    size_t remain_size = conn->rbuf_size - (len + 4);
-    if (remain_size > 0) {
-        memmove(conn->rbuf, conn->rbuf + len + 4, remain_size);
-    }
-    conn->rbuf_size = remain_size;
+static Entry *entry_new_hash(std::string_view key, uint64_t hcode) {
+    Entry *ent = entry_new(key, hcode, std::string_view());
+    Hash *hash = new Hash();
+    ent->type = T_HASH;
+    memcpy(ent->data + ent->klen, &hash, sizeof(hash));
+    g_data.entry_bytes += hash_mem(hash);
+    return ent;
+}
 
-    // update state(STARE_RES)
-    conn->state = STATE_RES;
-    state_res(conn);
+// hash_set() on an entry, with the memory accounting
+static bool entry_hset(Entry *ent, std::string_view field, std::string_view val) {
+    size_t before = entry_mem(ent);
+    bool added = hash_set(entry_hash(ent), field, val);
+    g_data.entry_bytes += entry_mem(ent) - before;
+    return added;
+}
 
-    return (conn->state == STATE_REQ);
+static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
+    // swap the erased item with the last item
+    a[pos] = a.back();
+    a.pop_back();
+    // update the swapped item
+    if (pos < a.size()) {
+        heap_update(a.data(), pos, a.size());
+    }
 }
 
-/**
- * fd2conn[conn->fd] = conn;
-*/
-static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
-    if (fd2conn.size() <= (size_t) conn->fd) {
-        fd2conn.resize(conn->fd + 1);
+static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
+    if (pos < a.size()) {
+        a[pos] = t;         // update an existing item
+    } else {
+        pos = a.size();
+        a.push_back(t);     // or add a new item
     }
-    fd2conn[conn->fd] = conn;
+    heap_update(a.data(), pos, a.size());
 }
 
 /**
- * accepts a new connection and creates the struct Conn object
- * @return 0 if accept successfully, else -1 
+ * set or remove the TTL
+ * @param ttl_ms the TTL in milliseconds, a negative one removes it
 */
-static int32_t accept_new_conn(std::vector<Conn *> &fd2conn, int fd) {
-    // accept
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *) &client_addr, &socklen);
-    if (connfd < 0) {
-        msg("accept() error");
-        return -1;
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
+    if (ttl_ms < 0 && ent->heap_idx != K_HEAP_NONE) {
+        heap_delete(g_data.heap, ent->heap_idx);
+        ent->heap_idx = K_HEAP_NONE;
+    } else if (ttl_ms >= 0) {
+        uint64_t expire_at = get_monotonic_msec() + (uint64_t) ttl_ms;
+        HeapItem item = {expire_at, &ent->heap_idx};
+        heap_upsert(g_data.heap, ent->heap_idx, item);
     }
+}
 
-    // set the new connection fd to nonblocking mode
-    fd_set_nb(connfd);
-    // creating the struct Conn
-    struct Conn *conn = (struct Conn *) malloc(sizeof(struct Conn));
-    if (!conn) {
-        close(connfd);
-        return -1;
+// the deadline in milliseconds, 0 if the key doesn't expire
+static uint64_t entry_expire_at(Entry *ent) {
+    if (ent->heap_idx == K_HEAP_NONE) {
+        return 0;
     }
-    conn->fd = connfd;
-    conn->state = STATE_REQ;
-    conn->rbuf_size = conn->wbuf_size = conn->wbuf_sent = 0;
-    conn_put(fd2conn, conn);
-    return 0; // success
+    return g_data.heap[ent->heap_idx].val;
 }
 
+static void entry_del(Entry *ent) {
+    g_data.entry_bytes -= entry_mem(ent);
+    entry_set_ttl(ent, -1);
+    if (ent->type == T_ZSET) {
+        ZSet *zset = entry_zset(ent);
+        zset_dispose(zset);
+        delete zset;
+    } else if (ent->type == T_HASH) {
+        Hash *hash = entry_hash(ent);
+        hash_dispose(hash);
+        delete hash;
+    } else if (!(ent->flags & (ENTRY_VAL_INLINE | ENTRY_VAL_INT))) {
+        free(entry_val_ptr(ent));
+    }
+    if (ent->sclass != K_SLAB_NONE) {
+        slab_free(ent, ent->sclass);
+    } else {
+        free(ent);
+    }
+}
 
+// values larger than these are freed by the lazyfree thread
+const size_t K_LAZYFREE_BYTES = 256 << 10;
+const size_t K_LAZYFREE_MEMBERS = 64;
+
+// the entry no longer owns its value, it can be freed cheaply
+// it's left with an empty string, inline in the room after the key of a slab entry
+static void entry_detach_val(Entry *ent) {
+    g_data.entry_bytes -= entry_mem(ent);
+    char *ptr = NULL;
+    memcpy(ent->data + ent->klen, &ptr, sizeof(ptr));
+    ent->type = T_STR;
+    ent->flags &= ~(ENTRY_VAL_INLINE | ENTRY_VAL_INT);
+    ent->vlen = ent->vcap = 0;
+    if (ent->sclass != K_SLAB_NONE) {
+        ent->flags |= ENTRY_VAL_INLINE;
+        ent->vcap = (uint32_t) (slab_class_size(ent->sclass) - offsetof(Entry, data) - ent->klen);
+    }
+    g_data.entry_bytes += entry_mem(ent);
+}
 
-static bool try_fill_buffer(Conn *conn) {
-    // try to fill the buffer
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
-    ssize_t rv = 0;
-
-    do {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
-    } while (rv < 0 && errno == EINTR);
-
-    if (rv < 0 && errno == EAGAIN) {
-        // got EAGAIN, stop.
+/**
+ * hand a large value to the lazyfree thread, the entry keeps an empty string.
+ * the value is detached first, the accounting reads it.
+ * @return false if the value is small, it's left in place
+*/
+static bool entry_lazyfree_val(Entry *ent) {
+    if (ent->type == T_ZSET && zset_size(entry_zset(ent)) > K_LAZYFREE_MEMBERS) {
+        ZSet *zset = entry_zset(ent);
+        entry_detach_val(ent);
+        lazyfree_zset(zset);
+    } else if (ent->type == T_HASH && hash_size(entry_hash(ent)) > K_LAZYFREE_MEMBERS) {
+        Hash *hash = entry_hash(ent);
+        entry_detach_val(ent);
+        lazyfree_hash(hash);
+    } else if (ent->type == T_STR && !(ent->flags & (ENTRY_VAL_INLINE | ENTRY_VAL_INT))
+        && ent->vcap >= K_LAZYFREE_BYTES) {
+        char *ptr = entry_val_ptr(ent);
+        entry_detach_val(ent);
+        lazyfree_mem(ptr);
+    } else {
         return false;
     }
-    if (rv < 0) {
-        msg("read() error");
-        conn->state = STATE_END;
-        return false;
+    return true;
+}
+
+// replace the value by an empty string, a large one is freed in the background
+static void entry_drop_val(Entry *ent) {
+    if (entry_lazyfree_val(ent)) {
+        return;
     }
-    if (rv == 0) {
-        if (conn->rbuf_size > 0) {
-            msg("unexpected EOF");
-        } else {
-            msg("EOF");
-        }
-        conn->state = STATE_END;
-        return false;
+    ZSet *zset = ent->type == T_ZSET ? entry_zset(ent) : NULL;
+    Hash *hash = ent->type == T_HASH ? entry_hash(ent) : NULL;
+    char *ptr = ent->type == T_STR && !(ent->flags & (ENTRY_VAL_INLINE | ENTRY_VAL_INT))
+        ? entry_val_ptr(ent) : NULL;
+    entry_detach_val(ent);
+    if (zset) {
+        zset_dispose(zset);
+        delete zset;
     }
-
-    conn->rbuf_size += (size_t) rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf));
-    
-    // Try to process requests one by one 
-    while (try_one_request(conn)) {}
-    return (conn->state == STATE_REQ);
+    if (hash) {
+        hash_dispose(hash);
+        delete hash;
+    }
+    free(ptr);
 }
 
-static bool try_flush_buffer(Conn *conn) {
-    ssize_t rv = 0;
-    do {
-        size_t remain_size = conn->wbuf_size - conn->wbuf_sent;
-        rv = write(conn->fd, conn->wbuf + conn->wbuf_sent, remain_size);
-    } while (rv < 0 && errno == EINTR); /* Interrupted system call */
+// like entry_del(), but a large value is freed in the background
+static void entry_unlink(Entry *ent) {
+    entry_lazyfree_val(ent);
+    entry_del(ent);
+}
 
-    if (rv < 0 && errno == EAGAIN) /* Try again */ {
-        // got EAGAIN, stop.
-        return false;
-    }
-    if (rv < 0) {
-        msg("write() error");
-        conn->state = STATE_END;
-        return false;
+// counters of the event loop, see the `info` command
+static thread_local struct {
+    uint64_t nreq = 0;          // requests executed
+    uint64_t req_allocs = 0;    // heap allocations made while executing them
+    uint64_t iterations = 0;    // epoll_wait() calls
+    uint64_t events = 0;        // ready fds reported by them
+    uint64_t max_events = 0;    // the most in one call
+    uint64_t bytes_in = 0;      // read from the clients
+    uint64_t bytes_out = 0;     // written to the clients
+    uint64_t evicted = 0;       // keys evicted over maxmemory
+} g_stats;
+
+// the state of the background save or AOF rewrite, see bg_fork()
+static struct {
+    std::atomic<bool> in_progress{false};   // one child at a time
+    std::atomic<uint32_t> npaused{0};       // the loops stopped by loops_pause()
+    std::atomic<bool> resume{false};
+    // written by one loop, read by all of them. owner is set after pid,
+    // and last_ok before in_progress is cleared, the atomics keep that order.
+    std::atomic<bool> rewrite{false};       // the child rewrites the AOF
+    std::atomic<pid_t> pid{-1};             // the child, reaped by its loop
+    std::atomic<int32_t> owner{-1};         // that loop
+    std::atomic<bool> last_ok{true};
+    std::atomic<bool> last_rewrite_ok{true};
+} g_save;
+
+// ====== allocation accounting ======
+// every allocation by new is counted, the per-request cost shows up in `info`
+static thread_local uint64_t g_nalloc = 0;
+
+void *operator new(size_t size) {
+    g_nalloc++;
+    void *ptr = malloc(size);
+    if (!ptr) {
+        throw std::bad_alloc();
     }
+    return ptr;
+}
 
-    conn->wbuf_sent += (size_t) rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
+void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
 
-    if (conn->wbuf_sent == conn->wbuf_size) {
-        // fully sent
-        conn->wbuf_sent = conn->wbuf_size = 0;
-        conn->state = STATE_REQ;
-        return false; // needn't write
-    }
+void operator delete(void *ptr, size_t size) noexcept {
+    (void) size;
+    free(ptr);
+}
 
-    // still got some data in wbuf, could try to write again
-    return true;
+static std::map<std::string, std::string> g_map;
+
+// the key for lookups, it refers to the request instead of copying the key
+struct LookupKey {
+    struct HNode node;
+    std::string_view key;
+};
+
+static void key_init(LookupKey *key, std::string_view name) {
+    key->key = name;
+    key->node.hcode = str_hash((uint8_t *)name.data(), name.size());
 }
 
-static void state_req(Conn *conn) {
-    while (try_fill_buffer(conn)) {}
+static bool entry_eq(HNode *lhs, HNode *rhs) {
+    struct Entry *le = container_of(lhs, struct Entry, node);
+    struct LookupKey *rk = container_of(rhs, struct LookupKey, node);
+    return lhs->hcode == rhs->hcode && entry_key(le) == rk->key;
 }
 
-static void state_res(Conn *conn) {
-    while(try_flush_buffer(conn)) {}
+static bool hnode_same(HNode *lhs, HNode *rhs) {
+    return lhs == rhs;
 }
 
-static void connection_io(Conn *conn) {
-    if (conn->state == STATE_REQ) {
-        state_req(conn);
-    } else if (conn->state == STATE_RES) {
-        state_res(conn);
-    } else {
-        assert(0); // not expect
-    }
+static bool entry_expired(Entry *ent, uint64_t now_ms) {
+    uint64_t expire_at = entry_expire_at(ent);
+    return expire_at != 0 && expire_at <= now_ms;
 }
 
-int main() {
-    // 1. Obtain a socket fd, AF_INET is for IPv4, SOCK_STREAM is for TCP
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        die("socket()");
+/**
+ * look up a key in the keyspace.
+ * a key may expire before the timers get to it, so it's checked here.
+ * @return NULL if not found or expired
+*/
+static Entry *db_lookup(LookupKey *key) {
+    HNode *node = hm_lookup(&g_data.db, &key->node, &entry_eq);
+    if (!node) {
+        return NULL;
     }
-    
-    // this is nedded for most server applications
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
-
-    // 2. bind, this is the syntax that deals with IPv4 addresses
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
-    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-    if (rv) {
-        die("bind()");
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent, get_monotonic_msec())) {
+        hm_pop(&g_data.db, node, &hnode_same);
+        entry_unlink(ent);
+        return NULL;
     }
+    entry_touch(ent);
+    return ent;
+}
 
-    // 3. listen
-    rv = listen(fd, SOMAXCONN);
-        if (rv) {
-        die("listen()");
-    }
+// ====== The code for our serialization protocol ======
+// TLV(type-length-value)
+// The values are encoded directly into the output buffer of the connection.
+static void out_nil(Buffer &out) {
+    buf_append_u8(&out, SER_NIL);
+}
 
-    // a map of all client connections, keyed by fd
-    std::vector<Conn *> fd2conn;
+static void out_str(Buffer &out, std::string_view val) {
+    // +---------+-------------+-----+------+--------
+    // | SER_STR | len(4Bytes) |   val(len Bytes)
+    // +---------+-------------+-----+------+--------
+    buf_reserve(&out, 1 + 4 + val.size());
+    buf_append_u8(&out, SER_STR);
+    buf_append_u32(&out, (uint32_t) val.size());
+    buf_append(&out, (const uint8_t *) val.data(), val.size());
+}
 
-    // set the listen fd to nonblocking mode
-    fd_set_nb(fd);
+static void out_int(Buffer &out, int64_t val) {
+    buf_append_u8(&out, SER_INT);
+    buf_append_i64(&out, val);
+}
 
-    // the event loop
-    std::vector<struct pollfd> poll_args;
-    while (true) {
-        // prepare the arguments of the poll()
-        poll_args.clear();
-        // for convenience, the listening fd is put in the first position
-        struct pollfd pfd = {fd, POLLIN, 0};
-        poll_args.push_back(pfd);
-
-        // connection fds
-        for (Conn *conn : fd2conn) {
-            if (!conn) {
-                continue;
-            }
+static void out_err(Buffer &out, int32_t code, std::string_view msg) {
+    buf_append_u8(&out, SER_ERR);
+    buf_append_u32(&out, (uint32_t) code); // 4 Bytes error code
+    buf_append_u32(&out, (uint32_t) msg.size());
+    buf_append(&out, (const uint8_t *) msg.data(), msg.size());
+}
 
-            struct pollfd pfd = {};
-            pfd.fd = conn->fd;
-            pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
-            pfd.events |= POLLERR;
-            poll_args.push_back(pfd);
-        }
+static void out_dbl(Buffer &out, double val) {
+    buf_append_u8(&out, SER_DBL);
+    buf_append(&out, (const uint8_t *) &val, 8);
+}
 
-        // poll for active fds
-        // the timeout argument doesn't matter here
-        int rv = poll(poll_args.data(), (nfds_t) poll_args.size(), 1000);
-        if (rv < 0) {
-            die("poll");
+static void out_arr(Buffer &out, uint32_t n) {
+    buf_append_u8(&out, SER_ARR);
+    buf_append_u32(&out, n);
+}
+
+/**
+ * start an array whose length is not known yet
+ * @return the position to patch with out_end_arr()
+*/
+static size_t out_begin_arr(Buffer &out) {
+    out_arr(out, 0);
+    return buf_size(&out) - 4;
+}
+
+static void out_end_arr(Buffer &out, size_t pos, uint32_t n) {
+    assert(out.data_begin[pos - 1] == SER_ARR);
+    memcpy(&out.data_begin[pos], &n, 4);
+}
+
+/**
+ * reserve the 4 bytes length header of a response
+ * @return the position of the header, the positions stay valid when the buffer grows
+*/
+static size_t resp_begin(Buffer &out) {
+    size_t header = buf_size(&out);
+    buf_append_u32(&out, 0);
+    return header;
+}
+
+static void resp_end(Buffer &out, size_t header) {
+    size_t msg_size = buf_size(&out) - header - 4;
+    if (msg_size > K_MAX_MSG) {
+        buf_truncate(&out, header + 4);
+        out_err(out, ERR_2BIG, "response is too big");
+        msg_size = buf_size(&out) - header - 4;
+    }
+    uint32_t len = (uint32_t) msg_size;
+    memcpy(&out.data_begin[header], &len, 4);
+}
+
+static void cb_scan(HNode *node, void *arg);
+static void do_bgsave(std::vector<std::string_view> &cmd, Buffer &out);
+static void do_bgrewriteaof(std::vector<std::string_view> &cmd, Buffer &out);
+static void aof_log(std::vector<std::string_view> &cmd);
+static void loop_flush_aof(Loop *loop);
+static void loop_sync_aof(Loop *loop);
+
+// the bytes of the keyspace: the entries, the hashtable and the TTL heap
+static size_t db_used_memory() {
+    return g_data.entry_bytes + hm_stats(&g_data.db).bytes
+        + g_data.heap.capacity() * sizeof(HeapItem);
+}
+
+// evict the best candidate of a few sampled keys, false if there is none
+static bool db_evict_one() {
+    HNode *samples[K_MAX_EVICT_SAMPLES];
+    size_t n = hm_sample(&g_data.db, rand_u64(), samples, g_config.maxmemory_samples);
+    if (n == 0) {
+        return false;
+    }
+    uint64_t now_ms = get_monotonic_msec();
+    Entry *best = NULL;
+    uint64_t best_score = 0;
+    for (size_t i = 0; i < n; i++) {
+        Entry *ent = container_of(samples[i], Entry, node);
+        uint64_t score = entry_evict_score(ent, now_ms);
+        if (!best || score > best_score) {
+            best = ent;
+            best_score = score;
+        }
+    }
+    hm_pop(&g_data.db, &best->node, &hnode_same);
+    // the AOF replays the eviction, it doesn't repeat the sampling
+    std::vector<std::string_view> del = {"del", entry_key(best)};
+    aof_log(del);
+    entry_unlink(best);
+    g_stats.evicted++;
+    return true;
+}
+
+// the most keys evicted for one write, a larger write makes progress over several
+const size_t K_MAX_EVICT_WORK = 64;
+
+/**
+ * called before the writes that add memory. evict some keys while the
+ * keyspace of this loop is over its share of maxmemory.
+ * @return false if the write is rejected, with the error in `out`
+*/
+static bool db_make_room(Buffer &out) {
+    if (g_config.maxmemory == 0) {
+        return true;
+    }
+    uint64_t limit = g_config.maxmemory / g_config.nthreads;
+    size_t nevicted = 0;
+    while (db_used_memory() > limit && nevicted < K_MAX_EVICT_WORK) {
+        if (g_config.maxmemory_policy == EVICT_NONE || !db_evict_one()) {
+            out_err(out, ERR_OOM, "over maxmemory");
+            return false;
+        }
+        nevicted++;
+    }
+    return true;
+}
+
+static void do_get(
+    std::vector<std::string_view> &cmd, 
+    Buffer &out) {
+    
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    
+    Entry *ent = db_lookup(&key);
+    if (NULL == ent) {
+        return out_nil(out);
+    }
+
+    if (ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    }
+    char buf[K_INT_CHARS];
+    std::string_view val = entry_val(ent, buf);
+   
+    assert(val.size() <= K_MAX_MSG);
+    return out_str(out, val);
+}
+
+// store a string value under the key, replacing a value of any type like redis
+static void db_set(LookupKey *key, std::string_view val) {
+    // the bytes are copied only here, when they are stored
+    Entry *ent = db_lookup(key);
+    if (NULL != ent) {
+        if (ent->type != T_STR) {
+            // a large sorted set or hash is freed in the background, like unlink
+            entry_drop_val(ent);
+        } else if (!(ent->flags & (ENTRY_VAL_INLINE | ENTRY_VAL_INT))
+            && val.size() < ent->vcap / 2) {
+            // shrink a buffer over twice the new value, it's freed in the
+            // background from K_LAZYFREE_BYTES up, here below that
+            entry_drop_val(ent);
+        }
+        entry_set_val(ent, val);
+        // like redis, a new value discards the TTL
+        entry_set_ttl(ent, -1);
+    } else {
+        Entry *entry = entry_new(key->key, key->node.hcode, val);
+        hm_insert(&g_data.db, &(entry->node));
+    }
+}
+
+static void do_set(
+    std::vector<std::string_view> &cmd, 
+    Buffer &out) {
+    if (!db_make_room(out)) {
+        return;
+    }
+
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    db_set(&key, cmd[2]);
+    return out_nil(out);
+}
+
+/**
+ * remove the key, with `lazy` a large value is freed in the background
+ * @return false if there was no such key
+*/
+static bool db_del(LookupKey *key, bool lazy) {
+    HNode *node = hm_pop(&g_data.db, &key->node, &entry_eq);
+    bool found = false;
+    if (NULL != node) {
+        Entry *ent = container_of(node, Entry, node);
+        found = !entry_expired(ent, get_monotonic_msec());
+        if (lazy) {
+            entry_unlink(ent);
+        } else {
+            entry_del(ent);
+        }
+    }
+    return found;
+}
+
+static void del_key(std::vector<std::string_view> &cmd, Buffer &out, bool lazy) {
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    return out_int(out, db_del(&key, lazy) ? 1 : 0);
+}
+
+static void do_del(
+    std::vector<std::string_view> &cmd, 
+    Buffer &out) {
+    return del_key(cmd, out, false);
+}
+
+// the key is gone at once, like del, but the memory is freed later
+static void do_unlink(std::vector<std::string_view> &cmd, Buffer &out) {
+    return del_key(cmd, out, true);
+}
+
+// ====== multi-key commands ======
+// The keys are hashed and their lookups prefetched a batch at a time,
+// so the cache misses of a batch overlap instead of adding up.
+
+// the keys prefetched at once, the prefetched lines must stay cached until used
+const size_t K_PREFETCH_BATCH = 16;
+
+static void db_prefetch(LookupKey *keys, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        hm_prefetch(&g_data.db, keys[i].node.hcode);
+    }
+    // the buckets are arriving by now, follow them to the entries
+    for (size_t i = 0; i < n; i++) {
+        hm_prefetch_node(&g_data.db, keys[i].node.hcode);
+    }
+}
+
+// mget key...: the values, nil for a missing key or another type
+static void do_mget(std::vector<std::string_view> &cmd, Buffer &out) {
+    size_t nkeys = cmd.size() - 1;
+    out_arr(out, (uint32_t) nkeys);
+    LookupKey keys[K_PREFETCH_BATCH];
+    for (size_t i = 0; i < nkeys; i += K_PREFETCH_BATCH) {
+        size_t n = std::min(K_PREFETCH_BATCH, nkeys - i);
+        for (size_t j = 0; j < n; j++) {
+            key_init(&keys[j], cmd[1 + i + j]);
+        }
+        db_prefetch(keys, n);
+        for (size_t j = 0; j < n; j++) {
+            Entry *ent = db_lookup(&keys[j]);
+            char buf[K_INT_CHARS];
+            if (ent && ent->type == T_STR) {
+                out_str(out, entry_val(ent, buf));
+            } else {
+                out_nil(out);
+            }
+        }
+    }
+}
+
+// mset key value [key value]...
+static void do_mset(std::vector<std::string_view> &cmd, Buffer &out) {
+    if (cmd.size() % 2 == 0) {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+    if (!db_make_room(out)) {
+        return;
+    }
+
+    size_t nkeys = cmd.size() / 2;
+    LookupKey keys[K_PREFETCH_BATCH];
+    for (size_t i = 0; i < nkeys; i += K_PREFETCH_BATCH) {
+        size_t n = std::min(K_PREFETCH_BATCH, nkeys - i);
+        for (size_t j = 0; j < n; j++) {
+            key_init(&keys[j], cmd[1 + 2 * (i + j)]);
+        }
+        db_prefetch(keys, n);
+        for (size_t j = 0; j < n; j++) {
+            db_set(&keys[j], cmd[2 + 2 * (i + j)]);
+        }
+    }
+    return out_nil(out);
+}
+
+// mdel key...: the number of keys removed
+static void do_mdel(std::vector<std::string_view> &cmd, Buffer &out) {
+    size_t nkeys = cmd.size() - 1;
+    int64_t ndel = 0;
+    LookupKey keys[K_PREFETCH_BATCH];
+    for (size_t i = 0; i < nkeys; i += K_PREFETCH_BATCH) {
+        size_t n = std::min(K_PREFETCH_BATCH, nkeys - i);
+        for (size_t j = 0; j < n; j++) {
+            key_init(&keys[j], cmd[1 + i + j]);
+        }
+        db_prefetch(keys, n);
+        for (size_t j = 0; j < n; j++) {
+            ndel += db_del(&keys[j], false) ? 1 : 0;
+        }
+    }
+    return out_int(out, ndel);
+}
+
+static bool cmd_is(std::string_view word, const char * cmd) {
+    return word.size() == strlen(cmd)
+        && 0 == strncasecmp(word.data(), cmd, word.size());
+}
+
+static bool str2dbl(std::string_view s, double &out) {
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && end == s.data() + s.size() && out == out;
+}
+
+static bool str2int(std::string_view s, int64_t &out) {
+    auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), out);
+    return ec == std::errc() && end == s.data() + s.size();
+}
+
+// add to the integer value of the key, a missing key counts as 0.
+// the value stays an int64, there is no string to parse and format.
+static void incr_by(std::vector<std::string_view> &cmd, Buffer &out, int64_t delta) {
+    if (!db_make_room(out)) {
+        return;
+    }
+
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = db_lookup(&key);
+    int64_t val = 0;
+    if (!ent) {
+        ent = entry_new(cmd[1], key.node.hcode, std::string_view());
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_STR) {
+        return out_err(out, ERR_TYPE, "expect string type");
+    } else if (ent->flags & ENTRY_VAL_INT) {
+        val = entry_int(ent);
+    } else if (!str_is_int(entry_val(ent, NULL), val)) {
+        // the same check as the storage, "007" is a string, not 7
+        return out_err(out, ERR_ARG, "value is not an integer");
+    }
+    if (__builtin_add_overflow(val, delta, &val)) {
+        return out_err(out, ERR_ARG, "increment or decrement would overflow");
+    }
+    // like redis, the TTL is kept
+    entry_set_int(ent, val);
+    return out_int(out, val);
+}
+
+static void do_incr(std::vector<std::string_view> &cmd, Buffer &out) {
+    return incr_by(cmd, out, 1);
+}
+
+static void do_decr(std::vector<std::string_view> &cmd, Buffer &out) {
+    return incr_by(cmd, out, -1);
+}
+
+// incrby key delta
+static void do_incrby(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int(cmd[2], delta)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    return incr_by(cmd, out, delta);
+}
+
+// decrby key delta
+static void do_decrby(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t delta = 0;
+    if (!str2int(cmd[2], delta) || delta == INT64_MIN) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    return incr_by(cmd, out, -delta);
+}
+
+/**
+ * look up a sorted set, a missing key is an empty set
+ * @return false if the key holds another type, the error is already sent
+*/
+static bool expect_zset(Buffer &out, std::string_view name, ZSet **zset) {
+    LookupKey key;
+    key_init(&key, name);
+    Entry *ent = db_lookup(&key);
+    *zset = NULL;
+    if (!ent) {
+        return true;
+    }
+    if (ent->type != T_ZSET) {
+        out_err(out, ERR_TYPE, "expect zset");
+        return false;
+    }
+    *zset = entry_zset(ent);
+    return true;
+}
+
+// zadd zset score name
+static void do_zadd(std::vector<std::string_view> &cmd, Buffer &out) {
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    if (!db_make_room(out)) {
+        return;
+    }
+
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = db_lookup(&key);
+    if (!ent) {
+        ent = entry_new_zset(cmd[1], key.node.hcode);
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_ZSET) {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+    bool added = entry_zadd(ent, cmd[3], score);
+    return out_int(out, (int64_t) added);
+}
+
+// zrem zset name
+static void do_zrem(std::vector<std::string_view> &cmd, Buffer &out) {
+    ZSet *zset = NULL;
+    if (!expect_zset(out, cmd[1], &zset)) {
+        return;
+    }
+    size_t before = zset ? zset_mem(zset) : 0;
+    ZNode *znode = zset ? zset_pop(zset, cmd[2]) : NULL;
+    if (znode) {
+        znode_del(znode);
+        g_data.entry_bytes -= before - zset_mem(zset);
+    }
+    return out_int(out, znode ? 1 : 0);
+}
+
+// zscore zset name
+static void do_zscore(std::vector<std::string_view> &cmd, Buffer &out) {
+    ZSet *zset = NULL;
+    if (!expect_zset(out, cmd[1], &zset)) {
+        return;
+    }
+    ZNode *znode = zset ? zset_lookup(zset, cmd[2]) : NULL;
+    return znode ? out_dbl(out, znode->score) : out_nil(out);
+}
+
+// zrank zset name
+static void do_zrank(std::vector<std::string_view> &cmd, Buffer &out) {
+    ZSet *zset = NULL;
+    if (!expect_zset(out, cmd[1], &zset)) {
+        return;
+    }
+    ZNode *znode = zset ? zset_lookup(zset, cmd[2]) : NULL;
+    return znode ? out_int(out, znode_rank(znode)) : out_nil(out);
+}
+
+// zquery zset score name offset limit
+// the members from (score, name) on, skipping `offset` of them,
+// as up to `limit` pairs of name and score
+static void do_zquery(std::vector<std::string_view> &cmd, Buffer &out) {
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    int64_t offset = 0;
+    int64_t limit = 0;
+    if (!str2int(cmd[4], offset) || !str2int(cmd[5], limit)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+
+    ZSet *zset = NULL;
+    if (!expect_zset(out, cmd[1], &zset)) {
+        return;
+    }
+    if (!zset || limit <= 0) {
+        return out_arr(out, 0);
+    }
+
+    // seek, then walk by rank instead of one node at a time
+    ZNode *znode = zset_query(zset, score, cmd[3]);
+    znode = znode_offset(znode, offset);
+
+    size_t arr = out_begin_arr(out);
+    uint32_t n = 0;
+    while (znode && (int64_t) (n / 2) < limit) {   // limit * 2 could overflow
+        out_str(out, znode_name(znode));
+        out_dbl(out, znode->score);
+        znode = znode_offset(znode, 1);
+        n += 2;
+    }
+    out_end_arr(out, arr, n);
+}
+
+static bool expect_hash(Buffer &out, std::string_view name, Hash **hash) {
+    LookupKey key;
+    key_init(&key, name);
+    Entry *ent = db_lookup(&key);
+    *hash = NULL;
+    if (!ent) {
+        return true;
+    }
+    if (ent->type != T_HASH) {
+        out_err(out, ERR_TYPE, "expect hash");
+        return false;
+    }
+    *hash = entry_hash(ent);
+    return true;
+}
+
+// hset hash field value [field value]...: the number of new fields
+static void do_hset(std::vector<std::string_view> &cmd, Buffer &out) {
+    if (cmd.size() % 2 != 0) {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+    if (!db_make_room(out)) {
+        return;
+    }
+
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = db_lookup(&key);
+    if (!ent) {
+        ent = entry_new_hash(cmd[1], key.node.hcode);
+        hm_insert(&g_data.db, &ent->node);
+    } else if (ent->type != T_HASH) {
+        return out_err(out, ERR_TYPE, "expect hash");
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        added += entry_hset(ent, cmd[i], cmd[i + 1]) ? 1 : 0;
+    }
+    return out_int(out, added);
+}
+
+// hget hash field
+static void do_hget(std::vector<std::string_view> &cmd, Buffer &out) {
+    Hash *hash = NULL;
+    if (!expect_hash(out, cmd[1], &hash)) {
+        return;
+    }
+    std::string_view val;
+    return hash && hash_get(hash, cmd[2], val) ? out_str(out, val) : out_nil(out);
+}
+
+// hdel hash field [field]...: the number of fields removed
+static void do_hdel(std::vector<std::string_view> &cmd, Buffer &out) {
+    Hash *hash = NULL;
+    if (!expect_hash(out, cmd[1], &hash)) {
+        return;
+    }
+    if (!hash) {
+        return out_int(out, 0);
+    }
+    size_t before = hash_mem(hash);
+    int64_t ndel = 0;
+    for (size_t i = 2; i < cmd.size(); i++) {
+        ndel += hash_del(hash, cmd[i]) ? 1 : 0;
+    }
+    g_data.entry_bytes -= before - hash_mem(hash);
+    return out_int(out, ndel);
+}
+
+// hlen hash
+static void do_hlen(std::vector<std::string_view> &cmd, Buffer &out) {
+    Hash *hash = NULL;
+    if (!expect_hash(out, cmd[1], &hash)) {
+        return;
+    }
+    return out_int(out, hash ? (int64_t) hash_size(hash) : 0);
+}
+
+static void cb_hgetall(std::string_view field, std::string_view val, void *arg) {
+    Buffer &out = *(Buffer *) arg;
+    out_str(out, field);
+    out_str(out, val);
+}
+
+// hgetall hash: the fields and their values, in no particular order
+static void do_hgetall(std::vector<std::string_view> &cmd, Buffer &out) {
+    Hash *hash = NULL;
+    if (!expect_hash(out, cmd[1], &hash)) {
+        return;
+    }
+    if (!hash) {
+        return out_arr(out, 0);
+    }
+    out_arr(out, (uint32_t) (hash_size(hash) * 2));
+    hash_foreach(hash, &cb_hgetall, &out);
+}
+
+// set the TTL, a non-positive one deletes the key
+static void expire_ms(std::vector<std::string_view> &cmd, Buffer &out, int64_t ttl_ms) {
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = db_lookup(&key);
+    if (!ent) {
+        return out_int(out, 0);
+    }
+    if (ttl_ms <= 0) {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_unlink(ent);
+    } else {
+        entry_set_ttl(ent, ttl_ms);
+    }
+    return out_int(out, 1);
+}
+
+// expire key seconds
+static void do_expire(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t ttl = 0;
+    if (!str2int(cmd[2], ttl) || ttl > INT64_MAX / 1000 || ttl < INT64_MIN / 1000) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    return expire_ms(cmd, out, ttl * 1000);
+}
+
+// pexpire key milliseconds
+static void do_pexpire(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t ttl_ms = 0;
+    if (!str2int(cmd[2], ttl_ms)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    return expire_ms(cmd, out, ttl_ms);
+}
+
+// pexpireat key unix-time-milliseconds
+static void do_pexpireat(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t at = 0;
+    if (!str2int(cmd[2], at)) {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    int64_t now_real = (int64_t) get_realtime_msec();
+    int64_t ttl_ms = at > now_real ? at - now_real : 0;
+    return expire_ms(cmd, out, ttl_ms);
+}
+
+/**
+ * the remaining TTL in milliseconds
+ * @return -2 if the key doesn't exist, -1 if it has no TTL
+*/
+static int64_t ttl_ms(std::string_view name) {
+    LookupKey key;
+    key_init(&key, name);
+    Entry *ent = db_lookup(&key);
+    if (!ent) {
+        return -2;
+    }
+    uint64_t expire_at = entry_expire_at(ent);
+    if (expire_at == 0) {
+        return -1;
+    }
+    uint64_t now_ms = get_monotonic_msec();
+    return expire_at > now_ms ? (int64_t) (expire_at - now_ms) : 0;
+}
+
+// ttl key
+static void do_ttl(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t ttl = ttl_ms(cmd[1]);
+    return out_int(out, ttl < 0 ? ttl : (ttl + 500) / 1000);
+}
+
+// pttl key
+static void do_pttl(std::vector<std::string_view> &cmd, Buffer &out) {
+    return out_int(out, ttl_ms(cmd[1]));
+}
+
+// persist key
+static void do_persist(std::vector<std::string_view> &cmd, Buffer &out) {
+    LookupKey key;
+    key_init(&key, cmd[1]);
+    Entry *ent = db_lookup(&key);
+    if (!ent || ent->heap_idx == K_HEAP_NONE) {
+        return out_int(out, 0);
+    }
+    entry_set_ttl(ent, -1);
+    return out_int(out, 1);
+}
+
+static void cb_keys_size(HNode *node, void *arg) {
+    *(size_t *)arg += 1 + 4 + container_of(node, Entry, node)->klen;
+}
+
+static void do_keys(std::vector<std::string_view> &cmd, Buffer &out) {
+    (void) cmd;
+    // the size is known before serializing, so an oversized reply
+    // is rejected up front and the buffer grows only once
+    size_t nbytes = 1 + 4;
+    hm_foreach(&g_data.db, &cb_keys_size, &nbytes);
+    if (nbytes > K_MAX_MSG) {
+        return out_err(out, ERR_2BIG, "response is too big");
+    }
+    buf_reserve(&out, nbytes);
+
+    out_arr(out ,(uint32_t)hm_size(&g_data.db));
+    hm_foreach(&g_data.db, &cb_scan, &out);
+}
+
+// the shard of a cursor is in its high bits, the position in its table below
+const uint32_t K_SCAN_SHARD_SHIFT = 56;
+// the default number of keys per batch
+const int64_t K_SCAN_COUNT = 10;
+// a larger count is clamped, it bounds the work of one call
+const int64_t K_SCAN_MAX_COUNT = K_MAX_ARGS;
+
+struct ScanCtx {
+    Buffer *out = NULL;
+    bool has_pattern = false;
+    std::string_view pattern;
+    uint64_t now_ms = 0;
+    uint32_t n = 0;
+};
+
+static void cb_scan_match(HNode *node, void *arg) {
+    ScanCtx *ctx = (ScanCtx *) arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent, ctx->now_ms)) {
+        return;
+    }
+    if (ctx->has_pattern && !glob_match(ctx->pattern, entry_key(ent))) {
+        return;
+    }
+    out_str(*ctx->out, entry_key(ent));
+    ctx->n++;
+}
+
+/**
+ * scan cursor [match pattern] [count n]
+ * reply with the next cursor and a batch of keys, the cursor 0 starts and ends
+ * the iteration. a key may be returned more than once, but a key that exists
+ * from the start to the end is always returned.
+*/
+static void do_scan(std::vector<std::string_view> &cmd, Buffer &out) {
+    int64_t cursor = 0;
+    if (!str2int(cmd[1], cursor) || cursor < 0) {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+    ScanCtx ctx;
+    ctx.out = &out;
+    ctx.now_ms = get_monotonic_msec();
+    int64_t count = K_SCAN_COUNT;
+    for (size_t i = 2; i < cmd.size(); i += 2) {
+        if (i + 1 < cmd.size() && cmd_is(cmd[i], "match")) {
+            ctx.has_pattern = cmd[i + 1] != "*";
+            ctx.pattern = cmd[i + 1];
+        } else if (i + 1 < cmd.size() && cmd_is(cmd[i], "count")) {
+            if (!str2int(cmd[i + 1], count) || count < 1) {
+                return out_err(out, ERR_ARG, "expect positive int");
+            }
+            count = std::min(count, K_SCAN_MAX_COUNT);
+        } else {
+            return out_err(out, ERR_ARG, "syntax error");
+        }
+    }
+
+    // the shards are scanned one after another
+    uint64_t shard = (uint64_t) cursor >> K_SCAN_SHARD_SHIFT;
+    uint64_t pos = (uint64_t) cursor & ((1ull << K_SCAN_SHARD_SHIFT) - 1);
+    if (shard != (uint64_t) g_loop->id) {
+        return out_err(out, ERR_ARG, "invalid cursor");
+    }
+
+    out_arr(out, 2);
+    out_int(out, 0);
+    size_t cursor_pos = buf_size(&out) - 8;
+    size_t arr = out_begin_arr(out);
+
+    // stop at `count` keys, or after visiting some empty buckets
+    size_t nvisits = 0;
+    do {
+        pos = hm_scan(&g_data.db, pos, &cb_scan_match, &ctx);
+        nvisits++;
+    } while (pos != 0 && ctx.n < (uint64_t) count && nvisits < (uint64_t) count * 10);
+
+    uint64_t next = (shard << K_SCAN_SHARD_SHIFT) | pos;
+    if (pos == 0) {
+        next = (shard + 1 < g_config.nthreads) ? (shard + 1) << K_SCAN_SHARD_SHIFT : 0;
+    }
+    memcpy(&out.data_begin[cursor_pos], &next, 8);
+    out_end_arr(out, arr, ctx.n);
+}
+
+static void cb_scan(HNode *node, void *arg) {
+    Buffer &out = *(Buffer *)arg;
+    out_str(out, entry_key(container_of(node, Entry, node)));
+}
+
+// ====== the command table ======
+static void do_info(std::vector<std::string_view> &cmd, Buffer &out);
+
+enum {
+    CMD_WRITE = 1,      // changes the keyspace, logged to the AOF
+    CMD_ALL_SHARDS = 2, // runs on every shard, the replies are merged
+    CMD_LOCAL = 4,      // runs on the loop of the connection
+    CMD_CURSOR = 8,     // runs on the shard encoded in the cursor
+    CMD_MULTI_KEY = 16, // every argument is a key, split by the shards
+    CMD_MULTI_KV = 32,  // the arguments are key value pairs, split by the shards
+};
+
+struct Command {
+    const char *name;
+    void (*handler)(std::vector<std::string_view> &cmd, Buffer &out);
+    int32_t arity;      // the number of arguments with the name, -n for at least n
+    uint32_t flags;
+};
+
+static constexpr Command k_commands[] = {
+    {"get", &do_get, 2, 0},
+    {"set", &do_set, 3, CMD_WRITE},
+    {"del", &do_del, 2, CMD_WRITE},
+    {"unlink", &do_unlink, 2, CMD_WRITE},
+    {"incr", &do_incr, 2, CMD_WRITE},
+    {"decr", &do_decr, 2, CMD_WRITE},
+    {"incrby", &do_incrby, 3, CMD_WRITE},
+    {"decrby", &do_decrby, 3, CMD_WRITE},
+    {"mget", &do_mget, -2, CMD_MULTI_KEY},
+    {"mset", &do_mset, -3, CMD_WRITE | CMD_MULTI_KV},
+    {"mdel", &do_mdel, -2, CMD_WRITE | CMD_MULTI_KEY},
+    {"keys", &do_keys, 1, CMD_ALL_SHARDS},
+    {"scan", &do_scan, -2, CMD_CURSOR},
+    {"info", &do_info, -1, CMD_LOCAL},
+    {"bgsave", &do_bgsave, 1, CMD_LOCAL},
+    {"bgrewriteaof", &do_bgrewriteaof, 1, CMD_LOCAL},
+    {"expire", &do_expire, 3, CMD_WRITE},
+    {"pexpire", &do_pexpire, 3, CMD_WRITE},
+    {"pexpireat", &do_pexpireat, 3, CMD_WRITE},
+    {"ttl", &do_ttl, 2, 0},
+    {"pttl", &do_pttl, 2, 0},
+    {"persist", &do_persist, 2, CMD_WRITE},
+    {"zadd", &do_zadd, 4, CMD_WRITE},
+    {"zrem", &do_zrem, 3, CMD_WRITE},
+    {"zscore", &do_zscore, 3, 0},
+    {"zrank", &do_zrank, 3, 0},
+    {"zquery", &do_zquery, 6, 0},
+    {"hset", &do_hset, -4, CMD_WRITE},
+    {"hget", &do_hget, 3, 0},
+    {"hdel", &do_hdel, -3, CMD_WRITE},
+    {"hlen", &do_hlen, 2, 0},
+    {"hgetall", &do_hgetall, 2, 0},
+};
+
+const uint32_t K_NCOMMANDS = sizeof(k_commands) / sizeof(k_commands[0]);
+
+// the names are found with a perfect hash: the seed is searched at compile
+// time so that no two names share a slot, and a lookup is one hash and one
+// comparison, no matter how many commands there are.
+const uint32_t K_CMD_SLOTS = 128;
+static_assert(K_NCOMMANDS <= K_CMD_SLOTS / 2, "grow K_CMD_SLOTS");
+
+// FNV-1a of the lowercased name
+static constexpr uint32_t cmd_hash(std::string_view name, uint32_t seed) {
+    uint32_t h = 0x811C9DC5 ^ seed;
+    for (char c : name) {
+        c = (c >= 'A' && c <= 'Z') ? (char) (c + 'a' - 'A') : c;
+        h = (h ^ (uint8_t) c) * 0x01000193;
+    }
+    return h ^ (h >> 16);
+}
+
+struct CmdIndex {
+    uint32_t seed = 0;
+    int8_t slots[K_CMD_SLOTS] = {};     // the index in k_commands, -1 for none
+};
+
+static constexpr CmdIndex cmd_index_build() {
+    CmdIndex index;
+    for (uint32_t seed = 0; ; seed++) {
+        for (int8_t &slot : index.slots) {
+            slot = -1;
+        }
+        bool ok = true;
+        for (uint32_t i = 0; i < K_NCOMMANDS && ok; i++) {
+            uint32_t pos = cmd_hash(k_commands[i].name, seed) & (K_CMD_SLOTS - 1);
+            ok = index.slots[pos] < 0;
+            index.slots[pos] = (int8_t) i;
+        }
+        if (ok) {
+            index.seed = seed;
+            return index;
+        }
+    }
+}
+
+static constexpr CmdIndex k_cmd_index = cmd_index_build();
+
+static const Command *cmd_lookup(std::string_view name) {
+    uint32_t pos = cmd_hash(name, k_cmd_index.seed) & (K_CMD_SLOTS - 1);
+    int8_t i = k_cmd_index.slots[pos];
+    return (i >= 0 && cmd_is(name, k_commands[i].name)) ? &k_commands[i] : NULL;
+}
+
+// the command of a request, NULL if it's unknown or has the wrong arity
+static const Command *cmd_find(std::vector<std::string_view> &cmd) {
+    const Command *c = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    if (!c) {
+        return NULL;
+    }
+    size_t nargs = cmd.size();
+    bool ok = c->arity >= 0 ? nargs == (size_t) c->arity : nargs >= (size_t) -c->arity;
+    return ok ? c : NULL;
+}
+
+// the calls, the time and the latencies of a command, in ticks
+struct CmdStats {
+    uint64_t calls = 0;
+    uint64_t ticks = 0;
+    LatencyHist hist;
+};
+
+// indexed like k_commands
+static thread_local CmdStats g_cmdstats[K_NCOMMANDS];
+
+static void out_stat(Buffer &out, const char *name, uint64_t val) {
+    out_str(out, name);
+    out_int(out, (int64_t) val);
+}
+
+static void out_stat(Buffer &out, const std::string &name, uint64_t val) {
+    out_stat(out, name.c_str(), val);
+}
+
+struct Stat {
+    const char *name;
+    uint64_t val;
+};
+
+static void info_general(Buffer &out, uint32_t &n) {
+    SlabStats slab = slab_stats();
+    struct mallinfo2 heap = mallinfo2();
+    HMapStats db = hm_stats(&g_data.db);
+    const Stat stats[] = {
+        {"requests", g_stats.nreq},
+        {"request_allocs", g_stats.req_allocs},
+        {"keys", hm_size(&g_data.db)},
+        {"expires", g_data.heap.size()},
+        {"db_slots", db.slots},
+        {"db_resizing_slots", db.old_slots},
+        {"db_resizing_left", db.moving},
+        {"used_memory", db_used_memory()},
+        {"maxmemory", g_config.maxmemory / g_config.nthreads},
+        {"evicted_keys", g_stats.evicted},
+        {"lazyfree_pending", lazyfree_pending()},
+        {"bgsave_in_progress", g_save.in_progress},
+        {"last_bgsave_ok", g_save.last_ok},
+        {"aof_rewrite_in_progress", g_save.in_progress && g_save.rewrite},
+        {"last_aof_rewrite_ok", g_save.last_rewrite_ok},
+        {"aof_size", aof_size()},
+        {"allocs", g_nalloc},
+        {"heap_used", heap.uordblks + heap.hblkhd},
+        {"slab_reserved", slab.reserved},
+        {"slab_used", slab.used},
+    };
+    for (const Stat &stat : stats) {
+        out_stat(out, stat.name, stat.val);
+        n += 2;
+    }
+}
+
+static void info_loop(Buffer &out, uint32_t &n) {
+    uint64_t nconns = 0;
+    for (Conn *conn : g_loop->fd2conn) {
+        nconns += conn != NULL;
+    }
+    const Stat stats[] = {
+        {"loop_id", (uint64_t) g_loop->id},
+        {"loop_iterations", g_stats.iterations},
+        {"loop_events", g_stats.events},
+        {"loop_max_events", g_stats.max_events},
+        {"loop_conns", nconns},
+        {"bytes_in", g_stats.bytes_in},
+        {"bytes_out", g_stats.bytes_out},
+    };
+    for (const Stat &stat : stats) {
+        out_stat(out, stat.name, stat.val);
+        n += 2;
+    }
+}
+
+// the commands that were called, the latencies in nanoseconds
+static void info_commands(Buffer &out, uint32_t &n) {
+    for (uint32_t i = 0; i < K_NCOMMANDS; i++) {
+        const CmdStats &stats = g_cmdstats[i];
+        if (stats.calls == 0) {
+            continue;
+        }
+        std::string prefix = std::string("cmd_") + k_commands[i].name;
+        out_stat(out, prefix + "_calls", stats.calls);
+        out_stat(out, prefix + "_nsec", ticks_to_nsec(stats.ticks));
+        out_stat(out, prefix + "_p50_nsec", ticks_to_nsec(hist_percentile(&stats.hist, 50)));
+        out_stat(out, prefix + "_p99_nsec", ticks_to_nsec(hist_percentile(&stats.hist, 99)));
+        out_stat(out, prefix + "_p999_nsec", ticks_to_nsec(hist_percentile(&stats.hist, 99.9)));
+        out_stat(out, prefix + "_max_nsec", ticks_to_nsec(stats.hist.max));
+        n += 12;
+    }
+}
+
+/**
+ * info [general|loop|commands]
+ * reply with name and value pairs, of the loop serving the connection.
+*/
+static void do_info(std::vector<std::string_view> &cmd, Buffer &out) {
+    if (cmd.size() > 2) {
+        return out_err(out, ERR_ARG, "wrong number of arguments");
+    }
+    std::string_view section = cmd.size() == 2 ? cmd[1] : "all";
+    bool all = cmd_is(section, "all");
+    if (!all && !cmd_is(section, "general") && !cmd_is(section, "loop")
+        && !cmd_is(section, "commands")) {
+        return out_err(out, ERR_ARG, "unknown section");
+    }
+    size_t arr = out_begin_arr(out);
+    uint32_t n = 0;
+    if (all || cmd_is(section, "general")) {
+        info_general(out, n);
+    }
+    if (all || cmd_is(section, "loop")) {
+        info_loop(out, n);
+    }
+    if (all || cmd_is(section, "commands")) {
+        info_commands(out, n);
+    }
+    out_end_arr(out, arr, n);
+}
+
+// execute a command and record its latency
+static int32_t do_request(std::vector<std::string_view> &cmd, Buffer &out) {
+    uint64_t start = ticks_now();
+    const Command *c = cmd_find(cmd);
+    if (!c) {
+        // the cmd is not recognized
+        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+        return 0;
+    }
+    size_t reply = buf_size(&out);
+    c->handler(cmd, out);
+    uint64_t ticks = ticks_now() - start;
+    CmdStats &stats = g_cmdstats[c - k_commands];
+    stats.calls++;
+    stats.ticks += ticks;
+    hist_add(&stats.hist, ticks);
+    if ((c->flags & CMD_WRITE) && out.data_begin[reply] != SER_ERR) {
+        // a rejected write changed nothing
+        aof_log(cmd);
+    }
+    return 0;
+}
+
+
+static void forward_request(Conn *conn, std::vector<std::string_view> &cmd, int32_t shard);
+static int32_t cmd_shard(std::vector<std::string_view> &cmd);
+
+static int32_t try_one_request(Conn *conn) {
+    // 4 bytes header, like this:
+    // +-----+------+-----+------+--------
+    // | len | msg1 | len | msg2 | more...
+    // +-----+------+-----+------+--------
+    
+    size_t rsize = buf_size(&conn->rbuf);
+    if (rsize < 4) {
+        // not enough data in the buffer. Will retry in the next iteration
+        return false;
+    }
+
+    uint32_t len = 0;
+    memcpy(&len, conn->rbuf.data_begin, 4);  // assume little endian
+    if (len > K_MAX_MSG) {
+        msg("too long");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (4 + len > rsize) {
+        // not enough data in the buffer. Will retry in the next iteration.
+        // make room for the whole message so it can be read at once.
+        buf_reserve(&conn->rbuf, 4 + len - rsize);
+        return false;
+    }
+
+    // parse the request
+    uint64_t nalloc = g_nalloc;
+    std::vector<std::string_view> &cmd = conn->cmd;
+    if (0 != parse_req(&conn->rbuf.data_begin[4], len, cmd)) {
+        msg("bad req");
+        conn->state = STATE_END;
+        return false;
+    }
+
+    // got one request, execute it here if this loop owns the keys
+    int32_t shard = cmd_shard(cmd);
+    if (shard != g_loop->id) {
+        forward_request(conn, cmd, shard);
+    } else {
+        // the response is queued in wbuf, and sent with the rest of the batch
+        size_t header = resp_begin(conn->wbuf);
+        do_request(cmd, conn->wbuf);
+        resp_end(conn->wbuf, header);
+    }
+
+    // remove the request from the buffer, the views are invalid from now on
+    cmd.clear();
+    buf_consume(&conn->rbuf, 4 + len);
+
+    g_stats.nreq++;
+    g_stats.req_allocs += g_nalloc - nalloc;
+    return conn->state == STATE_REQ && buf_size(&conn->wbuf) < K_WBUF_HIGH;
+}
+
+/**
+ * fd2conn[conn->fd] = conn;
+*/
+static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn) {
+    if (fd2conn.size() <= (size_t) conn->fd) {
+        fd2conn.resize(conn->fd + 1);
+    }
+    fd2conn[conn->fd] = conn;
+}
+
+/**
+ * the epoll interest of a connection follows its state:
+ * EPOLLIN while reading a request, EPOLLOUT while sending a response.
+*/
+static uint32_t conn_events(Conn *conn) {
+    uint32_t events = 0;
+    if (conn->state == STATE_REQ) {
+        events = EPOLLIN;
+    } else if (conn->state == STATE_RES) {
+        events = EPOLLOUT;
+    }
+    // STATE_WAIT: nothing to do until the forwarded command is replied,
+    // a hangup meanwhile is handled in loop_run()
+    if (g_config.epoll_et) {
+        events |= EPOLLET;
+    }
+    return events;
+}
+
+static void conn_epoll_ctl(int epfd, int op, Conn *conn) {
+    struct epoll_event ev = {};
+    ev.events = conn_events(conn);
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epfd, op, conn->fd, &ev) < 0) {
+        die("epoll_ctl()");
+    }
+}
+
+// move the connection to the back of the idle list, O(1)
+static void conn_touch(Loop *loop, Conn *conn, uint64_t now_ms) {
+    conn->idle_start = now_ms;
+    dlist_detach(&conn->idle_node);
+    dlist_insert_before(&loop->idle_list, &conn->idle_node);
+}
+
+/**
+ * accepts a new connection and creates the struct Conn object
+ * @return 0 if accept successfully, 1 if there is nothing to accept, else -1
+*/
+static int32_t accept_new_conn(Loop *loop) {
+    // accept
+    struct sockaddr_in client_addr = {};
+    socklen_t socklen = sizeof(client_addr);
+    int connfd = accept(loop->listen_fd, (struct sockaddr *) &client_addr, &socklen);
+    if (connfd < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 1;
+        }
+        msg("accept() error");
+        return -1;
+    }
+
+    // set the new connection fd to nonblocking mode
+    fd_set_nb(connfd);
+    // creating the struct Conn
+    // the buffers are allocated on demand
+    struct Conn *conn = new Conn();
+    conn->fd = connfd;
+    conn->state = STATE_REQ;
+    conn->idle_start = get_monotonic_msec();
+    dlist_insert_before(&loop->idle_list, &conn->idle_node);
+    conn_put(loop->fd2conn, conn);
+    // registered once, the interest is only modified on state changes
+    conn_epoll_ctl(loop->epfd, EPOLL_CTL_ADD, conn);
+    return 0; // success
+}
+
+static void conn_destroy(Loop *loop, Conn *conn) {
+    loop->fd2conn[conn->fd] = NULL; // delete it
+    dlist_detach(&conn->idle_node);
+    (void) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    (void) close(conn->fd);
+    buf_free(&conn->rbuf);
+    buf_free(&conn->wbuf);
+    delete conn;
+}
+
+// after the connection is processed, follow its new state
+static void conn_update(Loop *loop, Conn *conn, uint32_t old_state) {
+    if (conn->state == STATE_END) {
+        // client closed normally, or something bad happened.
+        // destroy this connection
+        conn_destroy(loop, conn);
+    } else if (conn->state != old_state) {
+        conn_epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn);
+    }
+}
+
+
+
+/**
+ * read once into rbuf
+ * @return true if the socket may have more data
+*/
+static bool try_fill_buffer(Conn *conn) {
+    // try to fill the buffer
+    buf_reserve(&conn->rbuf, K_READ_MIN);
+    size_t cap = buf_tail_room(&conn->rbuf);
+    ssize_t rv = 0;
+
+    do {
+        rv = read(conn->fd, conn->rbuf.data_end, cap);
+    } while (rv < 0 && errno == EINTR);
+
+    if (rv < 0 && errno == EAGAIN) {
+        // got EAGAIN, stop.
+        return false;
+    }
+    if (rv < 0) {
+        msg("read() error");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (rv == 0) {
+        if (buf_size(&conn->rbuf) > 0) {
+            msg("unexpected EOF");
+        } else {
+            msg("EOF");
+        }
+        conn->state = STATE_END;
+        return false;
+    }
+
+    conn->rbuf.data_end += rv;
+    g_stats.bytes_in += (uint64_t) rv;
+
+    // a short read drained the socket, level-triggered epoll will report new data.
+    // edge-triggered epoll needs a read() until EAGAIN.
+    return g_config.epoll_et || (size_t) rv == cap;
+}
+
+static bool try_flush_buffer(Conn *conn) {
+    ssize_t rv = 0;
+    do {
+        size_t remain_size = buf_size(&conn->wbuf);
+        rv = write(conn->fd, conn->wbuf.data_begin, remain_size);
+    } while (rv < 0 && errno == EINTR); /* Interrupted system call */
+
+    if (rv < 0 && errno == EAGAIN) /* Try again */ {
+        // got EAGAIN, stop.
+        return false;
+    }
+    if (rv < 0) {
+        msg("write() error");
+        conn->state = STATE_END;
+        return false;
+    }
+
+    buf_consume(&conn->wbuf, (size_t) rv);
+    g_stats.bytes_out += (uint64_t) rv;
+
+    if (buf_size(&conn->wbuf) == 0) {
+        // fully sent
+        buf_shrink(&conn->wbuf, K_BUF_KEEP);
+        conn->state = STATE_REQ;
+        return false; // needn't write
+    }
+
+    // still got some data in wbuf, could try to write again
+    return true;
+}
+
+static void state_req(Conn *conn) {
+    while (conn->state == STATE_REQ) {
+        bool more = try_fill_buffer(conn);
+        if (conn->state != STATE_REQ) {
+            return;
+        }
+
+        // Try to process the pipelined requests one by one,
+        // the responses are queued in wbuf
+        while (conn->state == STATE_REQ && try_one_request(conn)) {}
+        // give back the memory of a large message
+        buf_shrink(&conn->rbuf, K_BUF_KEEP);
+        if (conn->state != STATE_REQ) {
+            return;
+        }
+
+        bool full = buf_size(&conn->wbuf) >= K_WBUF_HIGH;
+        if (more && !full) {
+            continue;
+        }
+        if (buf_size(&conn->wbuf) == 0) {
+            return;
+        }
+        // send the responses of the whole batch with one write()
+        loop_sync_aof(g_loop);
+        conn->state = STATE_RES;
+        state_res(conn);
+        if (!full) {
+            return;
+        }
+        // the rest of the batch is still in rbuf
+    }
+}
+
+static void state_res(Conn *conn) {
+    while(try_flush_buffer(conn)) {}
+}
+
+static void connection_io(Conn *conn) {
+    if (conn->state == STATE_REQ) {
+        state_req(conn);
+    } else if (conn->state == STATE_RES) {
+        state_res(conn);
+        if (conn->state == STATE_REQ) {
+            // continue with the requests left in rbuf
+            state_req(conn);
+        }
+    } else if (conn->state == STATE_WAIT) {
+        // nothing to do until the forwarded command is replied
+    } else {
+        assert(0); // not expect
+    }
+}
+
+// ====== forwarding commands between loops ======
+// a command being executed by other loops on behalf of a connection
+struct Forward {
+    Conn *conn = NULL;
+    uint32_t pending = 0;           // number of shards yet to reply
+    std::vector<Buffer> outs;       // the partial replies, one per shard
+    std::vector<uint32_t> parts;    // a split multi-key command: the reply of each key
+};
+
+// the message passed between loops, there and back again
+struct Task {
+    QNode qnode;
+    Forward *fwd = NULL;
+    int32_t origin = 0;   // the loop owning the connection
+    size_t idx = 0;       // index into Forward::outs
+    bool done = false;    // executed, on its way back to the origin
+    bool pause = false;   // stop the loop until a snapshot is forked
+    std::vector<std::string> args;  // a copy, the request leaves rbuf of the origin
+    Buffer out;
+};
+
+static void loop_post(Loop *loop, Task *task) {
+    if (mpsc_push(&loop->inbox, &task->qnode)) {
+        uint64_t one = 1;
+        (void) write(loop->wake_fd, &one, sizeof(one));
+    }
+}
+
+// spread the keys with the high bits, the low bits pick the HMap slots
+static int32_t key_shard(std::string_view key) {
+    uint64_t h = str_hash((uint8_t *)key.data(), key.size());
+    h = (h * 0x9E3779B97F4A7C15ull) >> 32;
+    return (int32_t) ((h * g_config.nthreads) >> 32);
+}
+
+// the keys of a multi-key command are on several shards
+const int32_t K_SHARD_SPLIT = -2;
+
+static size_t cmd_key_step(const Command *c) {
+    return (c->flags & CMD_MULTI_KV) ? 2 : 1;
+}
+
+/**
+ * find the loop that owns the keys of the command
+ * @return the loop id, -1 if the command needs every shard,
+ * or K_SHARD_SPLIT if its keys are owned by several loops
+*/
+static int32_t cmd_shard(std::vector<std::string_view> &cmd) {
+    if (g_config.nthreads == 1) {
+        return g_loop->id;
+    }
+    const Command *c = cmd_find(cmd);
+    if (!c || (c->flags & CMD_LOCAL)) {
+        return g_loop->id;  // the errors are reported locally
+    }
+    if (c->flags & CMD_ALL_SHARDS) {
+        return -1;
+    }
+    if (c->flags & CMD_CURSOR) {
+        // the owner of the cursor, a bad one is reported locally
+        int64_t cursor = 0;
+        uint64_t shard = str2int(cmd[1], cursor) ? (uint64_t) cursor >> K_SCAN_SHARD_SHIFT : 0;
+        return shard < g_config.nthreads ? (int32_t) shard : g_loop->id;
+    }
+    if (c->flags & (CMD_MULTI_KEY | CMD_MULTI_KV)) {
+        size_t step = cmd_key_step(c);
+        if ((cmd.size() - 1) % step != 0) {
+            return g_loop->id;
+        }
+        int32_t shard = key_shard(cmd[1]);
+        for (size_t i = 1 + step; i < cmd.size(); i += step) {
+            if (key_shard(cmd[i]) != shard) {
+                return K_SHARD_SPLIT;
+            }
+        }
+        return shard;
+    }
+    if (cmd.size() >= 2) {
+        return key_shard(cmd[1]);
+    }
+    return g_loop->id;
+}
+
+// the keys of a split multi-key command owned by a shard, as the same command
+static void cmd_split_part(std::vector<std::string_view> &cmd, int32_t shard,
+    std::vector<std::string_view> &part) {
+    size_t step = cmd_key_step(cmd_find(cmd));
+    part.assign(1, cmd[0]);
+    for (size_t i = 1; i < cmd.size(); i += step) {
+        if (key_shard(cmd[i]) == shard) {
+            part.insert(part.end(), cmd.begin() + i, cmd.begin() + i + step);
+        }
+    }
+}
+
+// send each shard the keys it owns, as the same command
+static void forward_split(Conn *conn, std::vector<std::string_view> &cmd) {
+    size_t step = cmd_key_step(cmd_find(cmd));
+    Forward *fwd = new Forward();
+    fwd->conn = conn;
+    std::vector<Task *> tasks(g_config.nthreads, NULL);
+    for (size_t i = 1; i < cmd.size(); i += step) {
+        Task *&task = tasks[key_shard(cmd[i])];
+        if (!task) {
+            task = new Task();
+            task->fwd = fwd;
+            task->origin = g_loop->id;
+            task->idx = fwd->pending++;
+            task->args.emplace_back(cmd[0]);
+        }
+        fwd->parts.push_back((uint32_t) task->idx);
+        task->args.insert(task->args.end(), cmd.begin() + i, cmd.begin() + i + step);
+    }
+    fwd->outs.resize(fwd->pending);
+    conn->state = STATE_WAIT;
+
+    for (uint32_t shard = 0; shard < g_config.nthreads; shard++) {
+        if (tasks[shard]) {
+            loop_post(g_loops[shard], tasks[shard]);
+        }
+    }
+}
+
+static void forward_request(Conn *conn, std::vector<std::string_view> &cmd, int32_t shard) {
+    if (shard == K_SHARD_SPLIT) {
+        return forward_split(conn, cmd);
+    }
+    Forward *fwd = new Forward();
+    fwd->conn = conn;
+    fwd->pending = (shard < 0) ? g_config.nthreads : 1;
+    fwd->outs.resize(fwd->pending);
+    conn->state = STATE_WAIT;
+
+    for (uint32_t i = 0; i < fwd->pending; i++) {
+        Task *task = new Task();
+        task->fwd = fwd;
+        task->origin = g_loop->id;
+        task->idx = i;
+        task->args.assign(cmd.begin(), cmd.end());
+        loop_post(g_loops[shard < 0 ? i : (uint32_t) shard], task);
+    }
+}
+
+// concatenate the array replies of all shards into one array
+static void merge_arr(std::vector<Buffer> &outs, Buffer &out) {
+    uint32_t n = 0;
+    for (Buffer &part : outs) {
+        if (buf_size(&part) < 5 || part.data_begin[0] != SER_ARR) {
+            // errors are passed through
+            return buf_append(&out, part.data_begin, buf_size(&part));
+        }
+        uint32_t len = 0;
+        memcpy(&len, &part.data_begin[1], 4);
+        n += len;
+    }
+    out_arr(out, n);
+    for (Buffer &part : outs) {
+        buf_append(&out, part.data_begin + 5, buf_size(&part) - 5);
+    }
+}
+
+/**
+ * put the replies of a split multi-key command back together:
+ * the arrays are interleaved in the order of the keys, the integers
+ * are added up, and an error of any part is the reply.
+*/
+static void merge_split(Forward *fwd, Buffer &out) {
+    int64_t sum = 0;
+    for (Buffer &part : fwd->outs) {
+        if (part.data_begin[0] == SER_ERR) {
+            return buf_append(&out, part.data_begin, buf_size(&part));
+        }
+        if (part.data_begin[0] == SER_INT) {
+            int64_t val = 0;
+            memcpy(&val, &part.data_begin[1], 8);
+            sum += val;
+        }
+    }
+    Buffer &first = fwd->outs[0];
+    if (first.data_begin[0] == SER_INT) {
+        return out_int(out, sum);
+    }
+    if (first.data_begin[0] != SER_ARR) {
+        return buf_append(&out, first.data_begin, buf_size(&first));
+    }
+
+    // the elements are nil or strings, see do_mget()
+    std::vector<size_t> pos(fwd->outs.size(), 5);
+    out_arr(out, (uint32_t) fwd->parts.size());
+    for (uint32_t p : fwd->parts) {
+        const uint8_t *elem = fwd->outs[p].data_begin + pos[p];
+        size_t len = 1;
+        if (elem[0] == SER_STR) {
+            uint32_t n = 0;
+            memcpy(&n, &elem[1], 4);
+            len += 4 + n;
+        }
+        buf_append(&out, elem, len);
+        pos[p] += len;
+    }
+}
+
+static void forward_done(Loop *loop, Task *task) {
+    Forward *fwd = task->fwd;
+    fwd->outs[task->idx] = task->out;
+    delete task;
+    if (--fwd->pending > 0) {
+        return;
+    }
+
+    Conn *conn = fwd->conn;
+    size_t header = resp_begin(conn->wbuf);
+    if (!fwd->parts.empty()) {
+        merge_split(fwd, conn->wbuf);
+    } else if (fwd->outs.size() == 1) {
+        buf_append(&conn->wbuf, fwd->outs[0].data_begin, buf_size(&fwd->outs[0]));
+    } else {
+        merge_arr(fwd->outs, conn->wbuf);
+    }
+    resp_end(conn->wbuf, header);
+    for (Buffer &part : fwd->outs) {
+        buf_free(&part);
+    }
+    delete fwd;
+    if (conn->hangup) {
+        conn_destroy(loop, conn);
+        return;
+    }
+
+    // continue with the pipelined requests, and send the responses
+    conn->state = STATE_REQ;
+    state_req(conn);
+    conn_update(loop, conn, STATE_WAIT);
+}
+
+// ====== snapshot ======
+// A point-in-time copy of the keyspace, written by a forked child while the
+// loops keep serving. The fork shares the memory copy-on-write.
+// With several loops, all of them are paused between requests for the fork,
+// so the child sees every shard in a consistent state.
+//
+// The format is a sequence of records, the tags reuse the SER_* codes:
+// +-------+---------------------------+---------------------+
+// | magic | [SER_INT expire_at(8B)]   | tag key value       | ... | SER_NIL nkeys(8B)
+// +-------+---------------------------+---------------------+
+// key    := len(4B) bytes
+// value  := len(4B) bytes                  for SER_STR
+//         | n(4B) (len(4B) name score(8B))*n for SNAP_ZSET
+//         | n(4B) (len(4B) field len(4B) value)*n for SNAP_HASH
+// expire_at is the unix time in milliseconds.
+
+const char K_SNAP_MAGIC[8] = {'M', 'Y', 'R', 'E', 'D', 'I', 'S', '1'};
+// the sorted set and hash tags, the other tags are the SER_* codes
+const uint8_t SNAP_ZSET = 0x10;
+const uint8_t SNAP_HASH = 0x11;
+// the writes to the file are batched by this size
+const size_t K_SNAP_FLUSH = 1 << 20;
+
+struct SnapWriter {
+    int fd = -1;
+    bool ok = true;
+    Buffer buf;
+    Data *data = NULL;      // the shard being written
+    std::string_view key;   // the key of the members, for the AOF rewrite
+    uint64_t now_mono = 0;
+    uint64_t now_real = 0;
+    uint64_t nkeys = 0;
+};
+
+static void snap_flush(SnapWriter *w) {
+    if (w->ok && write_all(w->fd, (const char *) w->buf.data_begin, buf_size(&w->buf))) {
+        w->ok = false;
+    }
+    buf_consume(&w->buf, buf_size(&w->buf));
+}
+
+static void snap_bytes(SnapWriter *w, std::string_view s) {
+    buf_append_u32(&w->buf, (uint32_t) s.size());
+    buf_append(&w->buf, (const uint8_t *) s.data(), s.size());
+}
+
+static void cb_snap_member(HNode *node, void *arg) {
+    SnapWriter *w = (SnapWriter *) arg;
+    ZNode *znode = container_of(node, ZNode, hmap);
+    snap_bytes(w, znode_name(znode));
+    buf_append(&w->buf, (const uint8_t *) &znode->score, 8);
+    if (buf_size(&w->buf) >= K_SNAP_FLUSH) {
+        snap_flush(w);
+    }
+}
+
+static void cb_snap_field(std::string_view field, std::string_view val, void *arg) {
+    SnapWriter *w = (SnapWriter *) arg;
+    snap_bytes(w, field);
+    snap_bytes(w, val);
+    if (buf_size(&w->buf) >= K_SNAP_FLUSH) {
+        snap_flush(w);
+    }
+}
+
+static void cb_snap_entry(HNode *node, void *arg) {
+    SnapWriter *w = (SnapWriter *) arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (ent->heap_idx != K_HEAP_NONE) {
+        uint64_t expire_at = w->data->heap[ent->heap_idx].val;
+        if (expire_at <= w->now_mono) {
+            return;
+        }
+        buf_append_u8(&w->buf, SER_INT);
+        buf_append_i64(&w->buf, (int64_t) (w->now_real + (expire_at - w->now_mono)));
+    }
+    if (ent->type == T_ZSET) {
+        ZSet *zset = entry_zset(ent);
+        buf_append_u8(&w->buf, SNAP_ZSET);
+        snap_bytes(w, entry_key(ent));
+        buf_append_u32(&w->buf, (uint32_t) zset_size(zset));
+        hm_foreach(&zset->hmap, &cb_snap_member, w);
+    } else if (ent->type == T_HASH) {
+        Hash *hash = entry_hash(ent);
+        buf_append_u8(&w->buf, SNAP_HASH);
+        snap_bytes(w, entry_key(ent));
+        buf_append_u32(&w->buf, (uint32_t) hash_size(hash));
+        hash_foreach(hash, &cb_snap_field, w);
+    } else {
+        buf_append_u8(&w->buf, SER_STR);
+        snap_bytes(w, entry_key(ent));
+        char buf[K_INT_CHARS];
+        snap_bytes(w, entry_val(ent, buf));
+    }
+    w->nkeys++;
+    if (buf_size(&w->buf) >= K_SNAP_FLUSH) {
+        snap_flush(w);
+    }
+}
+
+// runs in the child, the file is replaced only when it's complete
+static bool snapshot_write(const char *path) {
+    std::string tmp = std::string(path) + ".tmp";
+    SnapWriter w;
+    w.fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w.fd < 0) {
+        msg("open() snapshot");
+        return false;
+    }
+    w.now_mono = get_monotonic_msec();
+    w.now_real = get_realtime_msec();
+    buf_append(&w.buf, (const uint8_t *) K_SNAP_MAGIC, sizeof(K_SNAP_MAGIC));
+    for (Loop *loop : g_loops) {
+        w.data = loop->data;
+        hm_foreach(&w.data->db, &cb_snap_entry, &w);
+    }
+    buf_append_u8(&w.buf, SER_NIL);
+    buf_append_i64(&w.buf, (int64_t) w.nkeys);
+    snap_flush(&w);
+
+    bool ok = w.ok && 0 == fsync(w.fd);
+    ok = 0 == close(w.fd) && ok;
+    ok = ok && 0 == rename(tmp.c_str(), path);
+    if (!ok) {
+        msg("failed to write the snapshot");
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+// ====== AOF rewrite ======
+// The child of bgrewriteaof writes the keyspace as the commands that
+// recreate it: set, zadd and hset per member, and pexpireat, in the
+// request format of the AOF. It's replayed like any AOF, see aof.cpp for
+// how the writes made meanwhile are appended.
+
+static void aof_rewrite_cmd(SnapWriter *w, const std::vector<std::string_view> &cmd) {
+    aof_append(&w->buf, cmd);
+    if (buf_size(&w->buf) >= K_SNAP_FLUSH) {
+        snap_flush(w);
+    }
+}
+
+static void cb_aof_member(HNode *node, void *arg) {
+    SnapWriter *w = (SnapWriter *) arg;
+    ZNode *znode = container_of(node, ZNode, hmap);
+    // the shortest form that is parsed back to the same double
+    char buf[32];
+    char *end = std::to_chars(buf, buf + sizeof(buf), znode->score).ptr;
+    std::string_view score(buf, (size_t) (end - buf));
+    aof_rewrite_cmd(w, {"zadd", w->key, score, znode_name(znode)});
+}
+
+static void cb_aof_field(std::string_view field, std::string_view val, void *arg) {
+    SnapWriter *w = (SnapWriter *) arg;
+    aof_rewrite_cmd(w, {"hset", w->key, field, val});
+}
+
+static void cb_aof_entry(HNode *node, void *arg) {
+    SnapWriter *w = (SnapWriter *) arg;
+    Entry *ent = container_of(node, Entry, node);
+    uint64_t expire_at = 0;
+    if (ent->heap_idx != K_HEAP_NONE) {
+        expire_at = w->data->heap[ent->heap_idx].val;
+        if (expire_at <= w->now_mono) {
+            return;
+        }
+    }
+    w->key = entry_key(ent);
+    if (ent->type == T_ZSET) {
+        ZSet *zset = entry_zset(ent);
+        if (zset_size(zset) == 0) {
+            // zrem leaves an empty sorted set, it's recreated the same way
+            aof_rewrite_cmd(w, {"zadd", w->key, "0", ""});
+            aof_rewrite_cmd(w, {"zrem", w->key, ""});
+        }
+        hm_foreach(&zset->hmap, &cb_aof_member, w);
+    } else if (ent->type == T_HASH) {
+        Hash *hash = entry_hash(ent);
+        if (hash_size(hash) == 0) {
+            aof_rewrite_cmd(w, {"hset", w->key, "", ""});
+            aof_rewrite_cmd(w, {"hdel", w->key, ""});
+        }
+        hash_foreach(hash, &cb_aof_field, w);
+    } else {
+        char buf[K_INT_CHARS];
+        aof_rewrite_cmd(w, {"set", w->key, entry_val(ent, buf)});
+    }
+    if (expire_at) {
+        char buf[K_INT_CHARS];
+        int64_t at = (int64_t) (w->now_real + (expire_at - w->now_mono));
+        aof_rewrite_cmd(w, {"pexpireat", w->key, int_str(at, buf)});
+    }
+    w->nkeys++;
+}
+
+// runs in the child, the AOF is replaced by the parent
+static bool aof_rewrite_write() {
+    SnapWriter w;
+    w.fd = aof_rewrite_open();
+    if (w.fd < 0) {
+        msg("open() aof rewrite");
+        return false;
+    }
+    w.now_mono = get_monotonic_msec();
+    w.now_real = get_realtime_msec();
+    for (Loop *loop : g_loops) {
+        w.data = loop->data;
+        hm_foreach(&w.data->db, &cb_aof_entry, &w);
+    }
+    snap_flush(&w);
+
+    bool ok = w.ok && 0 == fsync(w.fd);
+    ok = 0 == close(w.fd) && ok;
+    if (!ok) {
+        msg("failed to write the AOF rewrite");
+    }
+    return ok;
+}
+
+// ====== background child ======
+
+// a loop stops here until loops_resume(), its writes are logged first,
+// so the AOF rewrite doesn't see them in both the child and the tail
+static void loop_pause(Task *task) {
+    delete task;
+    loop_flush_aof(g_loop);
+    g_save.npaused++;
+    while (!g_save.resume) {
+        std::this_thread::yield();
+    }
+    g_save.npaused--;
+}
+
+// stop the other loops between their requests, one caller at a time
+static void loops_pause() {
+    for (Loop *loop : g_loops) {
+        if (loop != g_loop) {
+            Task *task = new Task();
+            task->pause = true;
+            loop_post(loop, task);
+        }
+    }
+    while (g_save.npaused != g_config.nthreads - 1) {
+        std::this_thread::yield();
+    }
+    loop_flush_aof(g_loop);
+}
+
+static void loops_resume() {
+    g_save.resume = true;
+    while (g_save.npaused != 0) {
+        std::this_thread::yield();
+    }
+    g_save.resume = false;
+}
+
+// the loop that forked reaps the child
+static void bg_check(Loop *loop) {
+    if (g_save.owner != loop->id) {
+        return;
+    }
+    int status = 0;
+    if (waitpid(g_save.pid, &status, WNOHANG) <= 0) {
+        return;
+    }
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (g_save.rewrite) {
+        // copy the tail while the loops run, then the rest of it paused
+        ok = ok && aof_rewrite_catch_up();
+        loops_pause();
+        ok = aof_rewrite_end(ok);
+        loops_resume();
+        g_save.last_rewrite_ok = ok;
+    } else {
+        g_save.last_ok = ok;
+    }
+    g_save.pid = -1;
+    g_save.owner = -1;
+    g_save.in_progress = false;
+}
+
+/**
+ * fork a child that writes the snapshot, or rewrites the AOF.
+ * the other loops are paused for the fork, so the child sees
+ * every shard in a consistent state.
+ * @return NULL, or the error
+*/
+static const char *bg_fork(bool rewrite) {
+    if (g_save.in_progress.exchange(true)) {
+        return "a background save is in progress";
+    }
+    loops_pause();
+    if (rewrite) {
+        // the writes logged from now on are not in the child
+        aof_rewrite_begin();
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the child has this thread only, and a frozen copy of all the shards
+        bool ok = rewrite ? aof_rewrite_write() : snapshot_write(g_config.snapshot);
+        _exit(ok ? 0 : 1);
+    }
+    if (pid < 0 && rewrite) {
+        aof_rewrite_end(false);
+    }
+    loops_resume();
+
+    if (pid < 0) {
+        g_save.in_progress = false;
+        return "fork() failed";
+    }
+    g_save.rewrite = rewrite;
+    g_save.pid = pid;
+    g_save.owner = g_loop->id;
+    return NULL;
+}
+
+// bgsave
+static void do_bgsave(std::vector<std::string_view> &cmd, Buffer &out) {
+    (void) cmd;
+    const char *err = bg_fork(false);
+    if (err) {
+        return out_err(out, ERR_UNKNOWN, err);
+    }
+    return out_str(out, "Background saving started");
+}
+
+// bgrewriteaof
+static void do_bgrewriteaof(std::vector<std::string_view> &cmd, Buffer &out) {
+    (void) cmd;
+    if (!aof_enabled()) {
+        return out_err(out, ERR_UNKNOWN, "the AOF is off");
+    }
+    const char *err = bg_fork(true);
+    if (err) {
+        return out_err(out, ERR_UNKNOWN, err);
+    }
+    return out_str(out, "Background AOF rewrite started");
+}
+
+struct SnapReader {
+    const uint8_t *cur = NULL;
+    const uint8_t *end = NULL;
+};
+
+static void snap_read(SnapReader *r, void *dst, size_t n) {
+    if ((size_t) (r->end - r->cur) < n) {
+        die("the snapshot is truncated");
+    }
+    memcpy(dst, r->cur, n);
+    r->cur += n;
+}
+
+static std::string_view snap_read_bytes(SnapReader *r) {
+    uint32_t len = 0;
+    snap_read(r, &len, 4);
+    if ((size_t) (r->end - r->cur) < len) {
+        die("the snapshot is truncated");
+    }
+    std::string_view s((const char *) r->cur, len);
+    r->cur += len;
+    return s;
+}
+
+// a file mapped by main(), each loop loads its own keys from it
+struct MappedFile {
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    std::atomic<uint32_t> nloading{0};
+};
+
+static MappedFile g_snap_file;
+static MappedFile g_aof_file;
+
+// @return false if the file doesn't exist or is empty
+static bool file_map(const char *path, MappedFile *file) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) < 0) {
+        die("fstat()");
+    }
+    if (st.st_size > 0) {
+        void *ptr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            die("mmap()");
         }
+        // read ahead aggressively, the file is parsed from start to end
+        (void) madvise(ptr, (size_t) st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+        file->data = (const uint8_t *) ptr;
+        file->size = (size_t) st.st_size;
+        file->nloading = g_config.nthreads;
+    }
+    close(fd);
+    return file->data != NULL;
+}
+
+// the last loop done with the file unmaps it
+static void file_loaded(MappedFile *file) {
+    if (--file->nloading == 0) {
+        munmap((void *) file->data, file->size);
+    }
+}
 
-        // process active connections
-        for (size_t i = 1; i < poll_args.size(); i++) {
-            if (poll_args[i].revents) {
-                Conn *conn = fd2conn[poll_args[i].fd];
-                connection_io(conn);
+// insert the keys of this loop's shard
+static void snapshot_load(Loop *loop) {
+    if (!g_snap_file.data) {
+        return;
+    }
+    SnapReader r;
+    r.cur = g_snap_file.data;
+    r.end = g_snap_file.data + g_snap_file.size;
+    char magic[sizeof(K_SNAP_MAGIC)];
+    snap_read(&r, magic, sizeof(magic));
+    if (memcmp(magic, K_SNAP_MAGIC, sizeof(magic))) {
+        die("not a snapshot");
+    }
 
-                if (conn->state == STATE_END) {
-                    // client closed normally, or something bad happened.
-                    // destroy this connection
-                    fd2conn[conn->fd] = NULL; // delete it
-                    (void) close(conn->fd);
-                    free(conn);
+    uint64_t now_real = get_realtime_msec();
+    uint64_t nkeys = 0;
+    while (true) {
+        uint8_t tag = 0;
+        snap_read(&r, &tag, 1);
+        if (tag == SER_NIL) {
+            break;
+        }
+        int64_t expire_at = 0;
+        if (tag == SER_INT) {
+            snap_read(&r, &expire_at, 8);
+            snap_read(&r, &tag, 1);
+        }
+        std::string_view key = snap_read_bytes(&r);
+        // the keys of the other shards are parsed but not kept
+        bool mine = g_config.nthreads == 1 || key_shard(key) == loop->id;
+        bool live = expire_at == 0 || (uint64_t) expire_at > now_real;
+        nkeys++;
+
+        Entry *ent = NULL;
+        if (tag == SER_STR) {
+            std::string_view val = snap_read_bytes(&r);
+            if (mine && live) {
+                uint64_t hcode = str_hash((const uint8_t *) key.data(), key.size());
+                ent = entry_new(key, hcode, val);
+            }
+        } else if (tag == SNAP_ZSET) {
+            uint32_t n = 0;
+            snap_read(&r, &n, 4);
+            if (mine && live) {
+                uint64_t hcode = str_hash((const uint8_t *) key.data(), key.size());
+                ent = entry_new_zset(key, hcode);
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                std::string_view name = snap_read_bytes(&r);
+                double score = 0;
+                snap_read(&r, &score, 8);
+                if (ent) {
+                    entry_zadd(ent, name, score);
+                }
+            }
+        } else if (tag == SNAP_HASH) {
+            uint32_t n = 0;
+            snap_read(&r, &n, 4);
+            if (mine && live) {
+                uint64_t hcode = str_hash((const uint8_t *) key.data(), key.size());
+                ent = entry_new_hash(key, hcode);
+            }
+            for (uint32_t i = 0; i < n; i++) {
+                std::string_view field = snap_read_bytes(&r);
+                std::string_view val = snap_read_bytes(&r);
+                if (ent) {
+                    entry_hset(ent, field, val);
                 }
             }
+        } else {
+            die("bad snapshot record");
+        }
+        if (ent) {
+            hm_insert(&g_data.db, &ent->node);
+            if (expire_at) {
+                entry_set_ttl(ent, expire_at - (int64_t) now_real);
+            }
+        }
+    }
+    int64_t total = 0;
+    snap_read(&r, &total, 8);
+    if ((uint64_t) total != nkeys) {
+        die("the snapshot is truncated");
+    }
+
+    file_loaded(&g_snap_file);
+}
+
+// ====== append-only file ======
+// The writes, the commands with CMD_WRITE, are logged in the request format,
+// so the replay is parse_req() and do_request(). Each loop collects the writes of an iteration and
+// appends them with one write(), see aof.cpp for the fsync policies.
+
+static void aof_log(std::vector<std::string_view> &cmd) {
+    if (!aof_enabled() || g_loop->replaying) {
+        return;
+    }
+    bool sec = cmd_is(cmd[0], "expire");
+    if (cmd.size() == 3 && (sec || cmd_is(cmd[0], "pexpire"))) {
+        // a relative TTL would restart at the replay, log the deadline instead
+        int64_t ttl = 0;
+        if (!str2int(cmd[2], ttl) || (sec && (ttl > INT64_MAX / 1000 || ttl < INT64_MIN / 1000))) {
+            return;     // rejected, nothing changed
+        }
+        ttl = sec ? ttl * 1000 : ttl;
+        int64_t now_real = (int64_t) get_realtime_msec();
+        int64_t at = ttl > INT64_MAX - now_real ? INT64_MAX : now_real + ttl;
+        char buf[K_INT_CHARS];
+        std::vector<std::string_view> rewritten = {"pexpireat", cmd[1], int_str(at, buf)};
+        return aof_append(&g_loop->aof_buf, rewritten);
+    }
+    aof_append(&g_loop->aof_buf, cmd);
+}
+
+// append the writes of this iteration to the file
+static void loop_flush_aof(Loop *loop) {
+    if (!aof_enabled()) {
+        return;
+    }
+    aof_write(&loop->aof_buf);
+    buf_shrink(&loop->aof_buf, K_BUF_KEEP);
+}
+
+// with AOF_FSYNC_ALWAYS, the writes are durable before their replies leave
+static void loop_sync_aof(Loop *loop) {
+    if (aof_enabled() && aof_policy() == AOF_FSYNC_ALWAYS) {
+        loop_flush_aof(loop);
+    }
+}
+
+/**
+ * map the AOF and drop an incomplete request at its end,
+ * which a crash in the middle of a write() leaves behind
+ * @return false if there is nothing to replay
+*/
+static bool aof_map(const char *path) {
+    if (!file_map(path, &g_aof_file)) {
+        return false;
+    }
+    size_t pos = 0;
+    while (pos + 4 <= g_aof_file.size) {
+        uint32_t len = 0;
+        memcpy(&len, &g_aof_file.data[pos], 4);
+        if (len > g_aof_file.size - pos - 4) {
+            break;
+        }
+        pos += 4 + len;
+    }
+    if (pos != g_aof_file.size) {
+        msg("the AOF ends with an incomplete request, truncated");
+        if (truncate(path, (off_t) pos) < 0) {
+            die("truncate() aof");
+        }
+        g_aof_file.size = pos;
+    }
+    return true;
+}
+
+// execute the writes of this loop's shard
+static void aof_replay(Loop *loop) {
+    if (!g_aof_file.data) {
+        return;
+    }
+    loop->replaying = true;
+    std::vector<std::string_view> cmd;
+    std::vector<std::string_view> part;
+    Buffer out;
+    size_t pos = 0;
+    while (pos + 4 <= g_aof_file.size) {
+        uint32_t len = 0;
+        memcpy(&len, &g_aof_file.data[pos], 4);
+        if (0 != parse_req(&g_aof_file.data[pos + 4], len, cmd)) {
+            die("bad request in the AOF");
+        }
+        int32_t shard = cmd.empty() ? -1 : cmd_shard(cmd);
+        if (shard == K_SHARD_SPLIT) {
+            // logged with other shards: another hash seed or number of loops
+            cmd_split_part(cmd, loop->id, part);
+            if (part.size() > 1) {
+                do_request(part, out);
+            }
+        } else if (shard == loop->id) {
+            do_request(cmd, out);
+        }
+        buf_consume(&out, buf_size(&out));
+        pos += 4 + len;
+    }
+    buf_free(&out);
+    loop->replaying = false;
+    file_loaded(&g_aof_file);
+}
+
+static void loop_handle_inbox(Loop *loop) {
+    uint64_t cnt = 0;
+    (void) read(loop->wake_fd, &cnt, sizeof(cnt));
+
+    QNode *node = mpsc_take_all(&loop->inbox);
+    QNode *replies = NULL;
+    while (node != NULL) {
+        Task *task = container_of(node, Task, qnode);
+        node = node->next;
+        if (task->pause) {
+            loop_pause(task);
+        } else if (!task->done) {
+            // execute the command on the shard owned by this loop
+            std::vector<std::string_view> cmd(task->args.begin(), task->args.end());
+            do_request(cmd, task->out);
+            task->done = true;
+            task->qnode.next = replies;
+            replies = &task->qnode;
+        } else {
+            forward_done(loop, task);
+        }
+    }
+
+    // the replies go back once the writes are logged
+    loop_sync_aof(loop);
+    while (replies != NULL) {
+        Task *task = container_of(replies, Task, qnode);
+        replies = replies->next;
+        loop_post(g_loops[task->origin], task);
+    }
+}
+
+static void epoll_add(int epfd, int fd, uint32_t events) {
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        die("epoll_ctl()");
+    }
+}
+
+static int listen_socket() {
+    // 1. Obtain a socket fd, AF_INET is for IPv4, SOCK_STREAM is for TCP
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    
+    // this is nedded for most server applications
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    // each loop listens on its own socket of the same port
+    if (g_config.nthreads > 1) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val));
+    }
+
+    // 2. bind, this is the syntax that deals with IPv4 addresses
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(1234);
+    addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
+    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+    if (rv) {
+        die("bind()");
+    }
+
+    // 3. listen
+    rv = listen(fd, SOMAXCONN);
+    if (rv) {
+        die("listen()");
+    }
+
+    // set the listen fd to nonblocking mode
+    fd_set_nb(fd);
+    return fd;
+}
+
+static Loop *loop_new(int32_t id) {
+    Loop *loop = new Loop();
+    loop->id = id;
+    dlist_init(&loop->idle_list);
+    loop->listen_fd = listen_socket();
+
+    // the epoll instance, the listening fd is registered for input
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd < 0) {
+        die("epoll_create1()");
+    }
+    uint32_t events = EPOLLIN;
+    if (g_config.epoll_et) {
+        events |= EPOLLET;
+    }
+    epoll_add(loop->epfd, loop->listen_fd, events);
+
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (loop->wake_fd < 0) {
+        die("eventfd()");
+    }
+    epoll_add(loop->epfd, loop->wake_fd, EPOLLIN);
+    return loop;
+}
+
+// the maximum number of keys expired per loop iteration,
+// so a burst of deadlines doesn't stall the connections
+const size_t K_MAX_EXPIRE_WORK = 2000;
+// the units of the keyspace resizing done per idle iteration
+const size_t K_IDLE_REHASH_WORK = 4096;
+
+// the timeout for epoll_wait(), -1 if there is no timer
+static int next_timer_ms(Loop *loop) {
+    if (hm_resizing(&g_data.db)) {
+        return 0;   // don't sleep while the keyspace is being resized
+    }
+    uint64_t next_ms = UINT64_MAX;
+    // the idle timer of the least recently active connection
+    if (g_config.idle_timeout_ms && !dlist_empty(&loop->idle_list)) {
+        Conn *conn = container_of(loop->idle_list.next, Conn, idle_node);
+        next_ms = conn->idle_start + g_config.idle_timeout_ms;
+    }
+    // the key that expires first
+    if (!g_data.heap.empty()) {
+        next_ms = std::min(next_ms, g_data.heap[0].val);
+    }
+    // poll the background child
+    if (g_save.owner == loop->id) {
+        next_ms = std::min(next_ms, get_monotonic_msec() + 100);
+    }
+    if (next_ms == UINT64_MAX) {
+        return -1;
+    }
+    uint64_t now_ms = get_monotonic_msec();
+    if (next_ms <= now_ms) {
+        return 0;   // missed or left over from the last iteration
+    }
+    return (int) std::min<uint64_t>(next_ms - now_ms, INT32_MAX);
+}
+
+static void process_timers(Loop *loop) {
+    uint64_t now_ms = get_monotonic_msec();
+    bg_check(loop);
+    if (!g_save.in_progress && aof_enabled() && aof_rewrite_due()) {
+        (void) bg_fork(true);
+    }
+    // close the idle connections, only the expired ones are visited
+    while (g_config.idle_timeout_ms && !dlist_empty(&loop->idle_list)) {
+        Conn *conn = container_of(loop->idle_list.next, Conn, idle_node);
+        if (conn->idle_start + g_config.idle_timeout_ms > now_ms) {
+            break;
+        }
+        if (conn->state == STATE_WAIT) {
+            // another loop will reply to it, the Conn must outlive that
+            conn_touch(loop, conn, now_ms);
+            continue;
+        }
+        conn_destroy(loop, conn);
+    }
+
+    std::vector<HeapItem> &heap = g_data.heap;
+    size_t nworks = 0;
+    while (!heap.empty() && heap[0].val <= now_ms && nworks < K_MAX_EXPIRE_WORK) {
+        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
+        HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
+        assert(node == &ent->node);
+        entry_unlink(ent);
+        nworks++;
+    }
+}
+
+static void loop_run(Loop *loop) {
+    g_loop = loop;
+    loop->data = &g_data;
+    snapshot_load(loop);
+    aof_replay(loop);
+
+    // the event loop
+    std::vector<struct epoll_event> events(K_MAX_EVENTS);
+    while (true) {
+        // wait for ready fds, only those are visited,
+        // or until the nearest timer
+        int timeout_ms = next_timer_ms(loop);
+        int nready = epoll_wait(loop->epfd, events.data(), (int) events.size(), timeout_ms);
+        if (nready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("epoll_wait");
+        }
+        if (nready == 0) {
+            // idle, move the resizing of the keyspace forward
+            hm_rehash(&g_data.db, K_IDLE_REHASH_WORK);
+        }
+        g_stats.iterations++;
+        g_stats.events += (uint64_t) nready;
+        g_stats.max_events = std::max(g_stats.max_events, (uint64_t) nready);
+
+        for (int i = 0; i < nready; i++) {
+            int ready_fd = events[i].data.fd;
+            if (ready_fd == loop->listen_fd) {
+                // accept until the backlog is drained, which edge-triggered mode requires
+                while (0 == accept_new_conn(loop)) {}
+                continue;
+            }
+            if (ready_fd == loop->wake_fd) {
+                loop_handle_inbox(loop);
+                continue;
+            }
+
+            Conn *conn = loop->fd2conn[ready_fd];
+            if (!conn) {
+                continue;   // destroyed by an earlier event of the batch
+            }
+            if (conn->state == STATE_WAIT && (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                // HUP/ERR can't be masked and would be reported on every
+                // epoll_wait(), stop watching the fd until the reply is back
+                conn->hangup = true;
+                (void) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+                continue;
+            }
+            conn_touch(loop, conn, get_monotonic_msec());
+            uint32_t old_state = conn->state;
+            connection_io(conn);
+            conn_update(loop, conn, old_state);
         }
 
-        // try to accept a new connection if the listening fd is active
-        if (poll_args[0].revents) {
-            (void) accept_new_conn(fd2conn, fd);
+        // close the idle connections and expire the keys
+        process_timers(loop);
+        // one write() for all the writes of the iteration
+        loop_flush_aof(loop);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--epoll-et | --epoll-lt] [--threads N] [--hash-seed N] [--idle-timeout MS] [--snapshot FILE]\n"
+        "    [--aof FILE] [--aof-fsync always|everysec|no]\n"
+        "    [--maxmemory BYTES[k|m|g]] [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu] [--maxmemory-samples N]\n", prog);
+    exit(1);
+}
+
+static void parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--epoll-et")) {
+            g_config.epoll_et = true;
+        } else if (0 == strcmp(argv[i], "--epoll-lt")) {
+            g_config.epoll_et = false;
+        } else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 1) {
+                usage(argv[0]);
+            }
+            g_config.nthreads = (uint32_t) n;
+        } else if (0 == strcmp(argv[i], "--hash-seed") && i + 1 < argc) {
+            // a fixed seed, for reproducible runs
+            str_hash_seed(strtoull(argv[++i], NULL, 0));
+        } else if (0 == strcmp(argv[i], "--idle-timeout") && i + 1 < argc) {
+            g_config.idle_timeout_ms = strtoull(argv[++i], NULL, 0);
+        } else if (0 == strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+            g_config.snapshot = argv[++i];
+        } else if (0 == strcmp(argv[i], "--aof") && i + 1 < argc) {
+            g_config.aof = argv[++i];
+        } else if (0 == strcmp(argv[i], "--maxmemory") && i + 1 < argc) {
+            // a number of bytes, with an optional k, m or g suffix
+            char *end = NULL;
+            g_config.maxmemory = strtoull(argv[++i], &end, 10);
+            switch (*end) {
+            case 'k': case 'K': g_config.maxmemory <<= 10; break;
+            case 'm': case 'M': g_config.maxmemory <<= 20; break;
+            case 'g': case 'G': g_config.maxmemory <<= 30; break;
+            case '\0': break;
+            default: usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "--maxmemory-policy") && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (0 == strcmp(policy, "noeviction")) {
+                g_config.maxmemory_policy = EVICT_NONE;
+            } else if (0 == strcmp(policy, "allkeys-lru")) {
+                g_config.maxmemory_policy = EVICT_LRU;
+            } else if (0 == strcmp(policy, "allkeys-lfu")) {
+                g_config.maxmemory_policy = EVICT_LFU;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (0 == strcmp(argv[i], "--maxmemory-samples") && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 1 || n > (int) K_MAX_EVICT_SAMPLES) {
+                usage(argv[0]);
+            }
+            g_config.maxmemory_samples = (uint32_t) n;
+        } else if (0 == strcmp(argv[i], "--aof-fsync") && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (0 == strcmp(policy, "always")) {
+                g_config.aof_fsync = AOF_FSYNC_ALWAYS;
+            } else if (0 == strcmp(policy, "everysec")) {
+                g_config.aof_fsync = AOF_FSYNC_EVERYSEC;
+            } else if (0 == strcmp(policy, "no")) {
+                g_config.aof_fsync = AOF_FSYNC_NO;
+            } else {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
         }
     }
+}
+
+int main(int argc, char **argv) {
+    // a random hash seed, so the clients cannot craft colliding keys
+    uint64_t seed = 0;
+    if (getrandom(&seed, sizeof(seed), 0) != sizeof(seed)) {
+        die("getrandom()");
+    }
+    str_hash_seed(seed);
+    ticks_init();
+    parse_args(argc, argv);
+    lazyfree_start();
+    // like redis, the AOF is more complete than the snapshot when it's on
+    if (g_config.aof) {
+        aof_map(g_config.aof);
+        aof_open(g_config.aof, g_config.aof_fsync);
+    } else {
+        file_map(g_config.snapshot, &g_snap_file);
+    }
+
+    for (uint32_t i = 0; i < g_config.nthreads; i++) {
+        g_loops.push_back(loop_new((int32_t) i));
+    }
+    // the main thread runs the first loop
+    for (uint32_t i = 1; i < g_config.nthreads; i++) {
+        std::thread(loop_run, g_loops[i]).detach();
+    }
+    loop_run(g_loops[0]);
 
     return 0;
-}
\ No newline at end of file
+}
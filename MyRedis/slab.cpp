@@ -0,0 +1,79 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "slab.h"
+#include "utils.h"
+
+// 16 bytes steps for the small sizes, coarser steps for the larger ones
+static const size_t K_CLASS_SIZES[] = {
+    32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+};
+const uint32_t K_NCLASS = sizeof(K_CLASS_SIZES) / sizeof(K_CLASS_SIZES[0]);
+
+// the memory is obtained from malloc in slabs of this size
+const size_t K_SLAB_SIZE = 64 << 10;
+
+// a freed object, linked in the free list of its class
+struct FreeObj {
+    FreeObj *next;
+};
+
+static thread_local struct {
+    FreeObj *free_list[K_NCLASS] = {};
+    SlabStats stats;
+} g_pool;
+
+uint32_t slab_class(size_t size) {
+    for (uint32_t i = 0; i < K_NCLASS; i++) {
+        if (size <= K_CLASS_SIZES[i]) {
+            return i;
+        }
+    }
+    return K_SLAB_NONE;
+}
+
+size_t slab_class_size(uint32_t sclass) {
+    assert(sclass < K_NCLASS);
+    return K_CLASS_SIZES[sclass];
+}
+
+// carve a new slab into objects of the class
+static void slab_refill(uint32_t sclass) {
+    size_t size = K_CLASS_SIZES[sclass];
+    char *slab = (char *) malloc(K_SLAB_SIZE);
+    if (!slab) {
+        die("out of memory");
+    }
+    g_pool.stats.reserved += K_SLAB_SIZE;
+
+    size_t n = K_SLAB_SIZE / size;
+    for (size_t i = n; i > 0; i--) {
+        FreeObj *obj = (FreeObj *) (slab + (i - 1) * size);
+        obj->next = g_pool.free_list[sclass];
+        g_pool.free_list[sclass] = obj;
+    }
+}
+
+void *slab_alloc(uint32_t sclass) {
+    assert(sclass < K_NCLASS);
+    if (!g_pool.free_list[sclass]) {
+        slab_refill(sclass);
+    }
+    FreeObj *obj = g_pool.free_list[sclass];
+    g_pool.free_list[sclass] = obj->next;
+    g_pool.stats.used += K_CLASS_SIZES[sclass];
+    return obj;
+}
+
+void slab_free(void *ptr, uint32_t sclass) {
+    assert(sclass < K_NCLASS);
+    FreeObj *obj = (FreeObj *) ptr;
+    obj->next = g_pool.free_list[sclass];
+    g_pool.free_list[sclass] = obj;
+    g_pool.stats.used -= K_CLASS_SIZES[sclass];
+}
+
+SlabStats slab_stats() {
+    return g_pool.stats;
+}
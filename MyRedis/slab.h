@@ -0,0 +1,35 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * size-classed allocator for small objects.
+ * objects are carved out of large slabs, and freed objects are recycled
+ * through a free list per class, so there is no malloc metadata per object.
+ * every thread has its own pool, an object must be freed by the thread
+ * that allocated it.
+*/
+
+// returned by slab_class() when the size is too large for the slabs
+const uint32_t K_SLAB_NONE = 0xff;
+
+// the smallest class that can hold `size` bytes
+uint32_t slab_class(size_t size);
+
+// the usable size of the objects of a class
+size_t slab_class_size(uint32_t sclass);
+
+void *slab_alloc(uint32_t sclass);
+
+void slab_free(void *ptr, uint32_t sclass);
+
+struct SlabStats {
+    size_t reserved = 0;    // bytes of slabs obtained from malloc
+    size_t used = 0;        // bytes of the live objects
+};
+
+SlabStats slab_stats();
+
+#endif
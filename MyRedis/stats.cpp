@@ -0,0 +1,86 @@
+#include <assert.h>
+#include <time.h>
+#include "stats.h"
+
+static uint64_t g_ticks_start = 0;
+static uint64_t g_nsec_start = 0;
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+void ticks_init() {
+    g_ticks_start = ticks_now();
+    g_nsec_start = get_monotonic_nsec();
+}
+
+uint64_t ticks_to_nsec(uint64_t ticks) {
+    uint64_t nsec = get_monotonic_nsec() - g_nsec_start;
+    uint64_t elapsed = ticks_now() - g_ticks_start;
+    if (nsec == 0 || elapsed == 0) {
+        return ticks;
+    }
+    return (uint64_t) ((double) ticks * (double) nsec / (double) elapsed);
+}
+
+static size_t hist_index(uint32_t sub_bits, uint64_t val) {
+    uint64_t sub_count = (uint64_t) 1 << sub_bits;
+    if (val < sub_count) {
+        return (size_t) val;    // exact for small values
+    }
+    uint32_t shift = 63 - __builtin_clzll(val) - sub_bits;
+    return ((size_t) (shift + 1) << sub_bits) + ((val >> shift) & (sub_count - 1));
+}
+
+// the highest value of a bucket
+static uint64_t hist_value(uint32_t sub_bits, size_t idx) {
+    uint64_t sub_count = (uint64_t) 1 << sub_bits;
+    if (idx < sub_count) {
+        return idx;
+    }
+    uint32_t shift = (uint32_t) (idx >> sub_bits) - 1;
+    uint64_t sub = idx & (sub_count - 1);
+    return ((sub_count + sub + 1) << shift) - 1;
+}
+
+static void hist_alloc(LatencyHist *hist) {
+    if (hist->counts.empty()) {
+        hist->counts.resize((size_t) 64 << hist->sub_bits);
+    }
+}
+
+void hist_add(LatencyHist *hist, uint64_t val) {
+    hist_alloc(hist);
+    hist->counts[hist_index(hist->sub_bits, val)]++;
+    hist->total++;
+    hist->max = val > hist->max ? val : hist->max;
+}
+
+void hist_merge(LatencyHist *dst, const LatencyHist *src) {
+    assert(dst->sub_bits == src->sub_bits);
+    hist_alloc(dst);
+    for (size_t i = 0; i < src->counts.size(); i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    dst->total += src->total;
+    dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+uint64_t hist_percentile(const LatencyHist *hist, double p) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (p / 100.0 * (double) hist->total + 0.5);
+    rank = rank < 1 ? 1 : rank;
+    uint64_t acc = 0;
+    for (size_t i = 0; i < hist->counts.size(); i++) {
+        acc += hist->counts[i];
+        if (acc >= rank) {
+            uint64_t val = hist_value(hist->sub_bits, i);
+            return val < hist->max ? val : hist->max;
+        }
+    }
+    return hist->max;
+}
@@ -0,0 +1,56 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * cheap timestamps for timing the requests.
+ * on x86 it's the TSC, a few cycles to read and no syscall,
+ * elsewhere the monotonic clock in nanoseconds.
+*/
+static inline uint64_t ticks_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+#endif
+}
+
+// remember the starting point of the calibration, called once at startup
+void ticks_init();
+
+// convert ticks, the rate is measured against the clock since ticks_init()
+uint64_t ticks_to_nsec(uint64_t ticks);
+
+/**
+ * latency histogram with log-linear buckets, like the HDR histogram:
+ * each power of 2 is split into 2^sub_bits buckets, so a value is kept
+ * within 1/2^sub_bits of its magnitude. the buckets are allocated by the
+ * first hist_add(), an unused histogram costs no more than the struct.
+*/
+const uint32_t K_HIST_SUB_BITS = 3;
+
+struct LatencyHist {
+    uint32_t sub_bits = K_HIST_SUB_BITS;    // set it before the first hist_add()
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t max = 0;
+};
+
+void hist_add(LatencyHist *hist, uint64_t val);
+
+// add the values of src, both have the same sub_bits
+void hist_merge(LatencyHist *dst, const LatencyHist *src);
+
+// the value at the percentile p (0 to 100), rounded up to its bucket
+uint64_t hist_percentile(const LatencyHist *hist, double p);
+
+#endif
@@ -175,6 +175,33 @@ static void test_remove(uint32_t sz) {
     }
 }
 
+static void test_offset(uint32_t sz) {
+    Container c;
+    for (uint32_t i = 0; i < sz; ++i) {
+        add(c, i);
+    }
+
+    AVLNode *min = c.root;
+    while (min && min->left) {
+        min = min->left;
+    }
+    for (uint32_t i = 0; i < sz; ++i) {
+        AVLNode *node = avl_offset(min, (int64_t)i);
+        assert(container_of(node, Data, node)->val == i);
+        assert(avl_rank(node) == (int64_t)i);
+
+        for (uint32_t j = 0; j < sz; ++j) {
+            int64_t offset = (int64_t)j - (int64_t)i;
+            AVLNode *n2 = avl_offset(node, offset);
+            assert(container_of(n2, Data, node)->val == j);
+        }
+        assert(!avl_offset(node, -(int64_t)i - 1));
+        assert(!avl_offset(node, (int64_t)(sz - i)));
+    }
+
+    dispose(c);
+}
+
 int main() {
     Container c;
 
@@ -220,6 +247,7 @@ int main() {
         test_insert(i);
         test_insert_dup(i);
         test_remove(i);
+        test_offset(i);
     }
 
     dispose(c);
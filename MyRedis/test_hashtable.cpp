@@ -0,0 +1,217 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "hashtable.h"
+#include "utils.h"
+
+// fuzz the HMap against std::unordered_map, across many resizes.
+// build it with the implementation under test, see `make test`.
+
+struct Data {
+    HNode node;
+    uint64_t key = 0;
+};
+
+// the hash function of a phase, a weak one makes long chains and probes
+static uint64_t (*g_hash)(uint64_t key) = NULL;
+
+static uint64_t hash_good(uint64_t key) {
+    return str_hash((const uint8_t *) &key, sizeof(key));
+}
+
+static uint64_t hash_weak(uint64_t key) {
+    return key % 61;
+}
+
+static bool data_eq(HNode *lhs, HNode *rhs) {
+    return container_of(lhs, Data, node)->key == container_of(rhs, Data, node)->key;
+}
+
+static HNode *lookup(HMap &hmap, uint64_t key) {
+    Data probe;
+    probe.key = key;
+    probe.node.hcode = g_hash(key);
+    // the prefetching only reads the table, whatever state it is in
+    hm_prefetch(&hmap, probe.node.hcode);
+    hm_prefetch_node(&hmap, probe.node.hcode);
+    return hm_lookup(&hmap, &probe.node, &data_eq);
+}
+
+static Data *pop(HMap &hmap, uint64_t key) {
+    Data probe;
+    probe.key = key;
+    probe.node.hcode = g_hash(key);
+    HNode *node = hm_pop(&hmap, &probe.node, &data_eq);
+    return node ? container_of(node, Data, node) : NULL;
+}
+
+static void cb_collect(HNode *node, void *arg) {
+    std::unordered_map<uint64_t, uint32_t> &seen = *(std::unordered_map<uint64_t, uint32_t> *) arg;
+    seen[container_of(node, Data, node)->key]++;
+}
+
+static void verify(HMap &hmap, const std::unordered_map<uint64_t, Data *> &ref) {
+    assert(hm_size(&hmap) == ref.size());
+    std::unordered_map<uint64_t, uint32_t> seen;
+    hm_foreach(&hmap, &cb_collect, &seen);
+    assert(seen.size() == ref.size());
+    for (const auto &kv : seen) {
+        assert(kv.second == 1);
+        auto it = ref.find(kv.first);
+        assert(it != ref.end());
+        assert(lookup(hmap, kv.first) == &it->second->node);
+    }
+}
+
+// a random mix of the operations, compared with the reference after each one
+static void fuzz(HMap &hmap, std::unordered_map<uint64_t, Data *> &ref,
+    uint64_t keyspace, uint32_t nops, uint32_t insert_pct) {
+    for (uint32_t i = 0; i < nops; i++) {
+        uint64_t key = (uint64_t) rand() % keyspace;
+        uint32_t op = (uint32_t) rand() % 100;
+        auto it = ref.find(key);
+        if (op < insert_pct) {
+            if (it != ref.end()) {
+                continue;
+            }
+            Data *data = new Data();
+            data->key = key;
+            data->node.hcode = g_hash(key);
+            hm_insert(&hmap, &data->node);
+            ref[key] = data;
+        } else if (op < insert_pct + (100 - insert_pct) / 2) {
+            Data *data = pop(hmap, key);
+            assert((data != NULL) == (it != ref.end()));
+            if (data) {
+                assert(data == it->second);
+                ref.erase(it);
+                delete data;
+            }
+        } else if (op % 8 == 0) {
+            // the idle time of the event loop
+            hm_rehash(&hmap, (size_t) rand() % 256);
+        } else {
+            HNode *node = lookup(hmap, key);
+            assert((node != NULL) == (it != ref.end()));
+            assert(!node || node == &it->second->node);
+        }
+        // a full check costs O(n), keep it to a fraction of the ops
+        if (i % (1024 + 16 * ref.size()) == 0) {
+            verify(hmap, ref);
+        }
+    }
+    verify(hmap, ref);
+}
+
+static void cb_scan(HNode *node, void *arg) {
+    std::unordered_set<uint64_t> &seen = *(std::unordered_set<uint64_t> *) arg;
+    seen.insert(container_of(node, Data, node)->key);
+}
+
+// a scan interleaved with the insertions and deletions of other keys
+// returns every key that was there from the start to the end
+static void scan_during_resizes(HMap &hmap, std::unordered_map<uint64_t, Data *> &ref) {
+    std::unordered_set<uint64_t> stable;
+    for (const auto &kv : ref) {
+        stable.insert(kv.first);
+    }
+    std::unordered_set<uint64_t> seen;
+    uint64_t cursor = 0;
+    uint64_t next_key = 1ull << 40;     // not in the fuzzed keyspace
+    std::vector<uint64_t> added;
+    do {
+        cursor = hm_scan(&hmap, cursor, &cb_scan, &seen);
+        // grow the table, then shrink it back
+        for (uint32_t j = 0; j < 4; j++) {
+            if (added.size() < 4 * stable.size() + 64) {
+                Data *data = new Data();
+                data->key = next_key++;
+                data->node.hcode = g_hash(data->key);
+                hm_insert(&hmap, &data->node);
+                added.push_back(data->key);
+            }
+        }
+    } while (cursor != 0);
+    for (uint64_t key : stable) {
+        assert(seen.count(key));
+    }
+    for (uint64_t key : added) {
+        delete pop(hmap, key);
+    }
+    verify(hmap, ref);
+}
+
+// drain a large table to a few keys, so it shrinks, then insert again.
+// an insert never has to finish a resizing at once, hm_insert() asserts it
+static void refill_after_shrink(HMap &hmap, std::unordered_map<uint64_t, Data *> &ref) {
+    uint64_t next_key = 1ull << 41;
+    std::vector<uint64_t> added;
+    for (uint32_t i = 0; i < 100000; i++) {
+        Data *data = new Data();
+        data->key = next_key++;
+        data->node.hcode = g_hash(data->key);
+        hm_insert(&hmap, &data->node);
+        added.push_back(data->key);
+    }
+    for (uint64_t key : added) {
+        delete pop(hmap, key);
+    }
+    added.clear();
+    for (uint32_t i = 0; i < 2000; i++) {
+        Data *data = new Data();
+        data->key = next_key++;
+        data->node.hcode = g_hash(data->key);
+        hm_insert(&hmap, &data->node);
+        added.push_back(data->key);
+    }
+    for (uint64_t key : added) {
+        delete pop(hmap, key);
+    }
+    verify(hmap, ref);
+}
+
+static void clear(HMap &hmap, std::unordered_map<uint64_t, Data *> &ref) {
+    for (const auto &kv : ref) {
+        Data *data = pop(hmap, kv.first);
+        assert(data == kv.second);
+        delete data;
+    }
+    ref.clear();
+    verify(hmap, ref);
+    // the table has shrunk back
+    while (hm_rehash(&hmap, 1024)) {}
+    assert(hm_stats(&hmap).slots <= 16);
+    hm_destroy(&hmap);
+}
+
+int main() {
+    str_hash_seed(1);
+    typedef uint64_t (*HashFn)(uint64_t);
+    for (HashFn hash : {&hash_good, &hash_weak}) {
+        g_hash = hash;
+        HMap hmap;
+        std::unordered_map<uint64_t, Data *> ref;
+
+        // some quick tests
+        verify(hmap, ref);
+        assert(!lookup(hmap, 123) && !pop(hmap, 123));
+
+        // a small keyspace, the resizes happen with the deletions
+        fuzz(hmap, ref, 100, 20000, 50);
+        // growing through many resizes
+        uint64_t keyspace = hash == &hash_weak ? 4000 : 200000;
+        fuzz(hmap, ref, keyspace, (uint32_t) keyspace * 2, 80);
+        scan_during_resizes(hmap, ref);
+        // shrinking, mostly deletions
+        fuzz(hmap, ref, keyspace, (uint32_t) keyspace * 2, 20);
+        if (hash == &hash_good) {
+            refill_after_shrink(hmap, ref);
+        }
+        clear(hmap, ref);
+    }
+    printf("ok\n");
+    return 0;
+}
@@ -1,5 +1,11 @@
 #include "utils.h"
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <utility>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 // ====== error message tools ======
 void msg(const char *msg) {
@@ -16,10 +22,257 @@ void die(const char *msg) {
 
 
 // ====== math and hash tools ======
+// A 64-bit hash in the style of wyhash: the input is read 8 bytes at a time
+// and mixed by 64x64->128 bit multiplications, with 3 independent lanes
+// for the bulk of longer keys.
+// When built with AVX2, keys of K_HASH_LONG bytes or more go through a
+// striped SIMD accumulator (like XXH3) instead. SSE2 has no 64-bit multiply
+// and is slower than the scalar lanes, so it has no such path.
+// The hash values of an AVX2 build differ, they are never persisted.
+
+static const uint64_t K_P0 = 0xa0761d6478bd642full;
+static const uint64_t K_P1 = 0xe7037ed1a0b428dbull;
+static const uint64_t K_P2 = 0x8ebc6af09c88c6e3ull;
+static const uint64_t K_P3 = 0x589965cc75374cc3ull;
+
+static uint64_t g_hash_seed = 0;
+
+static inline uint64_t rd64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t rd32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// multiply and fold the 128 bits product
+static inline uint64_t mum(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+#ifdef __AVX2__
+const size_t K_HASH_LONG = 1024;
+const size_t K_STRIPE = 64;             // 8 lanes of 64 bits
+const size_t K_STRIPES_PER_BLOCK = 16;  // the lanes are scrambled after a block
+
+// acc = (acc ^ (acc >> 47) ^ s) * prime, 64x32 bits with two 32x32 products
+static inline __m256i scramble(__m256i acc, __m256i secret) {
+    const __m256i prime = _mm256_set1_epi32((int) 0x9E3779B1u);
+    acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+    acc = _mm256_xor_si256(acc, secret);
+    __m256i lo = _mm256_mul_epu32(acc, prime);
+    __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+}
+
+// acc[i ^ 1] += d[i], acc[i] += lo32(d[i] ^ s[i]) * hi32(d[i] ^ s[i])
+static inline __m256i accumulate(__m256i acc, const uint8_t *p, __m256i secret) {
+    __m256i d = _mm256_loadu_si256((const __m256i *) p);
+    __m256i dk = _mm256_xor_si256(d, secret);
+    __m256i prod = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+    __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+    return _mm256_add_epi64(acc, _mm256_add_epi64(prod, swapped));
+}
+
+// consume the whole stripes of a long input, return the new seed
+static uint64_t hash_long(const uint8_t *p, size_t nstripes, uint64_t seed) {
+    uint64_t secret[8];
+    const uint64_t primes[4] = {K_P0, K_P1, K_P2, K_P3};
+    for (size_t i = 0; i < 8; i++) {
+        secret[i] = mum(seed ^ primes[i % 4], primes[(i + 1) % 4] + i);
+    }
+    __m256i s0 = _mm256_loadu_si256((const __m256i *) secret);
+    __m256i s1 = _mm256_loadu_si256((const __m256i *) secret + 1);
+    __m256i acc0 = _mm256_set_epi64x(K_P3, K_P2, K_P1, K_P0);
+    __m256i acc1 = _mm256_set_epi64x(K_P3, K_P2, K_P1, K_P0 ^ seed);
+
+    while (nstripes > 0) {
+        size_t n = nstripes < K_STRIPES_PER_BLOCK ? nstripes : K_STRIPES_PER_BLOCK;
+        for (size_t i = 0; i < n; i++, p += K_STRIPE) {
+            acc0 = accumulate(acc0, p, s0);
+            acc1 = accumulate(acc1, p + 32, s1);
+        }
+        acc0 = scramble(acc0, s0);
+        acc1 = scramble(acc1, s1);
+        nstripes -= n;
+    }
+
+    uint64_t acc[8];
+    _mm256_storeu_si256((__m256i *) acc, acc0);
+    _mm256_storeu_si256((__m256i *) acc + 1, acc1);
+    for (size_t i = 0; i < 8; i += 2) {
+        seed = mum(acc[i] ^ K_P1, acc[i + 1] ^ seed);
+    }
+    return seed;
+}
+#endif
+
+uint64_t str_hash_seeded(const uint8_t *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    seed ^= mum(seed ^ K_P0, K_P1);
+    uint64_t a = 0, b = 0;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (rd32(p) << 32) | rd32(p + ((len >> 3) << 2));
+            b = (rd32(p + len - 4) << 32) | rd32(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+        }
+    } else {
+        size_t i = len;
+#ifdef __AVX2__
+        if (len >= K_HASH_LONG) {
+            size_t nstripes = (len - 1) / K_STRIPE;
+            seed = hash_long(p, nstripes, seed);
+            p += nstripes * K_STRIPE;
+            i -= nstripes * K_STRIPE;
+        }
+#endif
+        if (i > 48) {
+            // 3 independent lanes
+            uint64_t s1 = seed, s2 = seed;
+            do {
+                seed = mum(rd64(p) ^ K_P1, rd64(p + 8) ^ seed);
+                s1 = mum(rd64(p + 16) ^ K_P2, rd64(p + 24) ^ s1);
+                s2 = mum(rd64(p + 32) ^ K_P3, rd64(p + 40) ^ s2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= s1 ^ s2;
+        }
+        while (i > 16) {
+            seed = mum(rd64(p) ^ K_P1, rd64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        // the last 16 bytes, they may overlap the processed ones
+        a = rd64(data + len - 16);
+        b = rd64(data + len - 8);
+    }
+    a ^= K_P1;
+    b ^= seed;
+    __uint128_t r = (__uint128_t) a * b;
+    a = (uint64_t) r;
+    b = (uint64_t) (r >> 64);
+    return mum(a ^ K_P0 ^ len, b ^ K_P1);
+}
+
+void str_hash_seed(uint64_t seed) {
+    g_hash_seed = seed;
+}
+
 uint64_t str_hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        h = (h + data[i]) * 0x01000193;
+    return str_hash_seeded(data, len, g_hash_seed);
+}
+
+
+// ====== string tools ======
+// match one character against the class at `pattern[p]` (after the '[')
+// @return the position after the closing ']'
+static size_t glob_class(std::string_view pattern, size_t p, char c, bool *matched) {
+    bool negate = p < pattern.size() && (pattern[p] == '^' || pattern[p] == '!');
+    if (negate) {
+        p++;
     }
-    return h;
-}
\ No newline at end of file
+    bool found = false;
+    while (p < pattern.size() && pattern[p] != ']') {
+        if (pattern[p] == '\\' && p + 1 < pattern.size()) {
+            p++;
+        }
+        char lo = pattern[p];
+        char hi = lo;
+        if (p + 2 < pattern.size() && pattern[p + 1] == '-' && pattern[p + 2] != ']') {
+            hi = pattern[p + 2];
+            p += 2;
+        }
+        if (lo > hi) {
+            std::swap(lo, hi);
+        }
+        found = found || (lo <= c && c <= hi);
+        p++;
+    }
+    *matched = found != negate;
+    return p < pattern.size() ? p + 1 : p;
+}
+
+bool glob_match(std::string_view pattern, std::string_view str) {
+    // on a mismatch, retry from the last `*` with one more character eaten,
+    // which bounds the work by len(pattern) * len(str)
+    size_t p = 0;
+    size_t s = 0;
+    size_t star_p = std::string_view::npos;
+    size_t star_s = 0;
+    while (s < str.size()) {
+        bool matched = false;
+        size_t next = p + 1;
+        if (p < pattern.size()) {
+            char c = pattern[p];
+            if (c == '*') {
+                star_p = p++;
+                star_s = s;
+                continue;
+            } else if (c == '?') {
+                matched = true;
+            } else if (c == '[') {
+                next = glob_class(pattern, p + 1, str[s], &matched);
+            } else {
+                if (c == '\\' && p + 1 < pattern.size()) {
+                    next = p + 2;
+                    c = pattern[p + 1];
+                }
+                matched = c == str[s];
+            }
+        }
+        if (matched) {
+            p = next;
+            s++;
+        } else if (star_p != std::string_view::npos) {
+            p = star_p + 1;
+            s = ++star_s;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+void *table_alloc(size_t bytes) {
+    if (bytes < K_TABLE_MMAP_BYTES) {
+        return calloc(bytes, 1);
+    }
+    void *ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        die("mmap()");
+    }
+    // fewer TLB misses on the random accesses, ignored without THP
+    (void) madvise(ptr, bytes, MADV_HUGEPAGE);
+    return ptr;
+}
+
+void table_free(void *ptr, size_t bytes) {
+    if (bytes < K_TABLE_MMAP_BYTES) {
+        free(ptr);
+    } else if (ptr) {
+        munmap(ptr, bytes);
+    }
+}
+
+void table_prefault(void *ptr, size_t bytes) {
+#ifdef MADV_POPULATE_WRITE
+    if (0 == madvise(ptr, bytes, MADV_POPULATE_WRITE)) {
+        return;
+    }
+#endif
+    // an older kernel, a write that keeps the content does the same
+    for (size_t i = 0; i < bytes; i += 4096) {
+        __atomic_fetch_add((uint8_t *) ptr + i, 0, __ATOMIC_RELAXED);
+    }
+}
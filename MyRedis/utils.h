@@ -3,13 +3,49 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string_view>
+
+#define container_of(ptr, type, member) ({                  \
+    const typeof( ((type *)0)->member ) *__mptr = (ptr);    \
+    (type *)( (char *)__mptr - offsetof(type, member) );})
 
 void msg(const char *msg);
 
 void die(const char *msg);
 
+// the hash of the keys, with the seed set by str_hash_seed()
 uint64_t str_hash(const uint8_t *data, size_t len);
 
+uint64_t str_hash_seeded(const uint8_t *data, size_t len, uint64_t seed);
+
+/**
+ * set the seed of str_hash(), call it before any thread starts.
+ * a random seed keeps clients from crafting colliding keys.
+*/
+void str_hash_seed(uint64_t seed);
+
+/**
+ * glob-style matching, like the patterns of redis:
+ * `*`, `?`, `[abc]`, `[a-z]`, `[^abc]` and `\` to escape
+*/
+bool glob_match(std::string_view pattern, std::string_view str);
+
+/**
+ * zeroed arrays for the hashtables.
+ * the large ones are mmap'ed, so the pages are zeroed by the kernel on the
+ * first touch instead of all at once, and backed by huge pages if possible.
+*/
+void *table_alloc(size_t bytes);
+
+void table_free(void *ptr, size_t bytes);
+
+// fault in the pages of [ptr, ptr + bytes) ahead of their first use
+void table_prefault(void *ptr, size_t bytes);
+
+// the arrays from this size on are mmap'ed and prefaulted
+const size_t K_TABLE_MMAP_BYTES = 1 << 20;
+
 #endif
\ No newline at end of file
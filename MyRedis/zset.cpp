@@ -0,0 +1,176 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "zset.h"
+#include "utils.h"
+
+static ZNode *znode_new(std::string_view name, double score) {
+    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + name.size());
+    assert(node);
+    avl_init(&node->tree);
+    node->hmap.hcode = str_hash((const uint8_t *)name.data(), name.size());
+#ifndef HMAP_SWISS
+    node->hmap.next = NULL;
+#endif
+    node->score = score;
+    node->len = name.size();
+    memcpy(&node->name[0], name.data(), name.size());
+    return node;
+}
+
+void znode_del(ZNode *node) {
+    free(node);
+}
+
+// compare the (score, name) of a node with a pair
+static bool zless(AVLNode *lhs, double score, std::string_view name) {
+    ZNode *zl = container_of(lhs, ZNode, tree);
+    if (zl->score != score) {
+        return zl->score < score;
+    }
+    return znode_name(zl) < name;
+}
+
+static bool zless(AVLNode *lhs, AVLNode *rhs) {
+    ZNode *zr = container_of(rhs, ZNode, tree);
+    return zless(lhs, zr->score, znode_name(zr));
+}
+
+static void tree_add(ZSet *zset, ZNode *node) {
+    if (!zset->tree) {
+        zset->tree = &node->tree;
+        return;
+    }
+
+    AVLNode *cur = zset->tree;
+    while (true) {
+        AVLNode **from = zless(&node->tree, cur) ? &cur->left : &cur->right;
+        if (!*from) {
+            *from = &node->tree;
+            node->tree.parent = cur;
+            zset->tree = avl_fix(&node->tree);
+            break;
+        }
+        cur = *from;
+    }
+}
+
+// reinsert the node to move it to its new position
+static void zset_update(ZSet *zset, ZNode *node, double score) {
+    if (node->score == score) {
+        return;
+    }
+    zset->tree = avl_del(&node->tree);
+    avl_init(&node->tree);
+    node->score = score;
+    tree_add(zset, node);
+}
+
+// a name to look up in the hashtable
+struct HKey {
+    HNode node;
+    std::string_view name;
+};
+
+static bool hcmp(HNode *node, HNode *key) {
+    ZNode *znode = container_of(node, ZNode, hmap);
+    HKey *hkey = container_of(key, HKey, node);
+    return node->hcode == key->hcode && znode_name(znode) == hkey->name;
+}
+
+static void hkey_init(HKey *key, std::string_view name) {
+    key->node.hcode = str_hash((const uint8_t *)name.data(), name.size());
+    key->name = name;
+}
+
+bool zset_add(ZSet *zset, std::string_view name, double score) {
+    ZNode *node = zset_lookup(zset, name);
+    if (node) {
+        zset_update(zset, node, score);
+        return false;
+    }
+    node = znode_new(name, score);
+    zset->node_bytes += sizeof(ZNode) + name.size();
+    hm_insert(&zset->hmap, &node->hmap);
+    tree_add(zset, node);
+    return true;
+}
+
+ZNode *zset_lookup(ZSet *zset, std::string_view name) {
+    if (!zset->tree) {
+        return NULL;
+    }
+    HKey key;
+    hkey_init(&key, name);
+    HNode *found = hm_lookup(&zset->hmap, &key.node, &hcmp);
+    return found ? container_of(found, ZNode, hmap) : NULL;
+}
+
+ZNode *zset_pop(ZSet *zset, std::string_view name) {
+    if (!zset->tree) {
+        return NULL;
+    }
+    HKey key;
+    hkey_init(&key, name);
+    HNode *found = hm_pop(&zset->hmap, &key.node, &hcmp);
+    if (!found) {
+        return NULL;
+    }
+    ZNode *node = container_of(found, ZNode, hmap);
+    zset->tree = avl_del(&node->tree);
+    zset->node_bytes -= sizeof(ZNode) + node->len;
+    return node;
+}
+
+ZNode *zset_query(ZSet *zset, double score, std::string_view name) {
+    AVLNode *found = NULL;
+    AVLNode *cur = zset->tree;
+    while (cur) {
+        if (zless(cur, score, name)) {
+            cur = cur->right;
+        } else {
+            found = cur;    // candidate
+            cur = cur->left;
+        }
+    }
+    return found ? container_of(found, ZNode, tree) : NULL;
+}
+
+ZNode *znode_offset(ZNode *node, int64_t offset) {
+    AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
+    return tnode ? container_of(tnode, ZNode, tree) : NULL;
+}
+
+int64_t znode_rank(ZNode *node) {
+    return avl_rank(&node->tree);
+}
+
+size_t zset_size(ZSet *zset) {
+    return hm_size(&zset->hmap);
+}
+
+static bool hcmp_same(HNode *node, HNode *key) {
+    return node == key;
+}
+
+static void tree_dispose(ZSet *zset, AVLNode *node) {
+    if (!node) {
+        return;
+    }
+    tree_dispose(zset, node->left);
+    tree_dispose(zset, node->right);
+    ZNode *znode = container_of(node, ZNode, tree);
+    hm_pop(&zset->hmap, &znode->hmap, &hcmp_same);
+    znode_del(znode);
+}
+
+void zset_dispose(ZSet *zset) {
+    tree_dispose(zset, zset->tree);
+    zset->tree = NULL;
+    zset->node_bytes = 0;
+    hm_destroy(&zset->hmap);
+}
+
+size_t zset_mem(ZSet *zset) {
+    return sizeof(ZSet) + zset->node_bytes + hm_stats(&zset->hmap).bytes;
+}
@@ -0,0 +1,63 @@
+#ifndef _ZSET_H
+#define _ZSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include "avl.h"
+#include "hashtable.h"
+
+/**
+ * sorted set.
+ * the members are indexed twice: by name in the hashtable,
+ * and by the (score, name) pair in the AVL tree for the range queries.
+*/
+struct ZSet {
+    AVLNode *tree = NULL;
+    HMap hmap;
+    size_t node_bytes = 0;  // the allocations of the members
+};
+
+struct ZNode {
+    AVLNode tree;
+    HNode hmap;
+    double score = 0;
+    size_t len = 0;
+    char name[];
+};
+
+static inline std::string_view znode_name(ZNode *node) {
+    return std::string_view(node->name, node->len);
+}
+
+/**
+ * add a member or update the score of an existing one
+ * @return true if the member is new
+*/
+bool zset_add(ZSet *zset, std::string_view name, double score);
+
+ZNode *zset_lookup(ZSet *zset, std::string_view name);
+
+// detach a member, the caller frees it with znode_del()
+ZNode *zset_pop(ZSet *zset, std::string_view name);
+
+// the first member that is >= (score, name)
+ZNode *zset_query(ZSet *zset, double score, std::string_view name);
+
+// walk by `offset` positions in the sorted order
+ZNode *znode_offset(ZNode *node, int64_t offset);
+
+// the position of the member in the sorted order, starting from 0
+int64_t znode_rank(ZNode *node);
+
+void znode_del(ZNode *node);
+
+size_t zset_size(ZSet *zset);
+
+// free all the members
+void zset_dispose(ZSet *zset);
+
+// the bytes used by the set, the members and the hashtable
+size_t zset_mem(ZSet *zset);
+
+#endif